@@ -0,0 +1,315 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include <benchmark/benchmark.h>
+
+#include "LevenshteinDistance.h"
+#include "LRUChildrenKeysCache.h"
+#include "BKTree.h"
+
+#include "DatasetGenerator.h"
+#include "CountingStorage.h"
+#include "TimedDistancePolicy.h"
+
+//
+// insert throughput, query latency percentiles, cache hit ratio, storage reads and distance time per tree size
+//
+// BKTree_Bench [benchmark flags] [--sizes=10000,100000,1000000,10000000] [--directory=/tmp]
+//
+// each size is loaded once from DatasetGenerator into a fresh tree, queried and then inserted into
+// --benchmark_format=json or --benchmark_out=<file> --benchmark_out_format=json writes every counter for comparing runs
+//
+
+using Distance = TimedDistancePolicy<LevenshteinDistancePolicy>;
+using Storage = CountingStorage<LevelDBStorage>;
+using Tree = BKTree<Distance, NoCachePolicy, DisableChildrenKey, Storage>;
+using CachedTree = BKTree<Distance, LRUChildrenKeysCache, DisableChildrenKey, Storage>;
+
+// keys generated and written per bulk load call
+static constexpr std::uint64_t LoadChunkSize = 1 << 20;
+// queries run by each query benchmark, in order, again from the first when the iterations go beyond
+static constexpr std::size_t QueryCount = 10000;
+// queries repeated with distance timing on after the timed loop
+static constexpr std::size_t SampledQueryCount = 1000;
+
+//
+// the tree of the current size on disk, opened by one tree type at a time since LevelDB locks its databases
+//
+class Environment {
+private:
+  std::string _directory;
+  DatasetGenerator _generator;
+
+  std::uint64_t _size = 0;
+  // keys inserted beyond the dictionary, they continue its indexes
+  std::uint64_t _inserted = 0;
+  std::vector<std::string> _queries;
+
+  std::shared_ptr<Storage> _values;
+  std::shared_ptr<Storage> _indexes;
+  std::unique_ptr<Tree> _tree;
+  std::unique_ptr<CachedTree> _cachedTree;
+
+public:
+  static Environment& instance() {
+    static Environment environment;
+    return environment;
+  }
+
+  void setDirectory(const std::string& directory) {
+    _directory = directory;
+  }
+
+  const DatasetGenerator& generator() const {
+    return _generator;
+  }
+
+  const std::vector<std::string>& queries() const {
+    return _queries;
+  }
+
+  std::uint64_t nextKeyIndex() {
+    return _size + _inserted++;
+  }
+
+  Storage& values() {
+    return *_values;
+  }
+
+  Storage& indexes() {
+    return *_indexes;
+  }
+
+  Tree& tree(std::uint64_t size) {
+    prepare(size);
+
+    if (!_tree) {
+      _cachedTree.reset();
+      open();
+      _tree.reset(Tree::New(_values, _indexes));
+    }
+
+    return *_tree;
+  }
+
+  CachedTree& cachedTree(std::uint64_t size) {
+    prepare(size);
+
+    if (!_cachedTree) {
+      _tree.reset();
+      open();
+      _cachedTree.reset(CachedTree::New(_values, _indexes));
+    }
+
+    return *_cachedTree;
+  }
+
+private:
+  std::string path() const {
+    return _directory + "/bktree_bench";
+  }
+
+  void open() {
+    _values.reset();
+    _indexes.reset();
+
+    _values = Storage::open(path());
+    _indexes = Storage::open(path() + "_i", LevelDBStorage::Options::indexes());
+  }
+
+  void prepare(std::uint64_t size) {
+    if (size == _size)
+      return;
+
+    _tree.reset();
+    _cachedTree.reset();
+    _values.reset();
+    _indexes.reset();
+
+    leveldb::DestroyDB(path(), leveldb::Options());
+    leveldb::DestroyDB(path() + "_i", leveldb::Options());
+
+    open();
+    std::unique_ptr<Tree> tree{ Tree::New(_values, _indexes) };
+
+    for (std::uint64_t first = 0; first < size; first += LoadChunkSize) {
+      auto keyValues = _generator.keyValues(first, std::min(size, first + LoadChunkSize));
+      tree->bulkLoad(keyValues.begin(), keyValues.end());
+    }
+
+    _size = size;
+    _inserted = 0;
+    _queries = _generator.queries(size, QueryCount);
+  }
+};
+
+static double percentile(std::vector<double>& latencies, double rank) {
+  auto nth = latencies.begin() + std::min(latencies.size() - 1, static_cast<std::size_t>(rank * latencies.size()));
+  std::nth_element(latencies.begin(), nth, latencies.end());
+  return *nth;
+}
+
+//
+// counters of a sample of queries run again with distance timing on, per query
+//
+template<typename QueryTree>
+static void sampleCounters(benchmark::State& state, QueryTree& tree, std::uint32_t threshold) {
+  auto& environment = Environment::instance();
+  const auto& queries = environment.queries();
+  auto count = std::min(SampledQueryCount, queries.size());
+
+  auto valueReads = environment.values().reads();
+  auto indexReads = environment.indexes().reads();
+  auto indexCalls = environment.indexes().calls();
+  std::size_t results = 0;
+
+  Distance::reset();
+  Distance::enable(true);
+
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i != count; ++i) {
+    results += tree.query(queries[i], threshold, static_cast<std::uint32_t>(-1)).size();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+  Distance::enable(false);
+  auto distance = Distance::counters();
+
+  state.counters["results_per_query"] = static_cast<double>(results) / count;
+  state.counters["value_reads_per_query"] = static_cast<double>(environment.values().reads() - valueReads) / count;
+  state.counters["index_reads_per_query"] = static_cast<double>(environment.indexes().reads() - indexReads) / count;
+  state.counters["index_read_calls_per_query"] = static_cast<double>(environment.indexes().calls() - indexCalls) / count;
+  state.counters["distances_per_query"] = static_cast<double>(distance.distances) / count;
+  state.counters["distance_time_share"] = elapsed > 0 ? static_cast<double>(distance.nanoseconds) / elapsed : 0.0;
+}
+
+template<typename QueryTree>
+static void latencyCounters(benchmark::State& state, QueryTree& tree, std::uint32_t threshold) {
+  const auto& queries = Environment::instance().queries();
+  std::vector<double> latencies;
+  std::size_t i = 0;
+
+  for (auto _ : state) {
+    auto start = std::chrono::steady_clock::now();
+    benchmark::DoNotOptimize(tree.query(queries[i], threshold, static_cast<std::uint32_t>(-1)));
+    latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+
+    i = (i + 1) % queries.size();
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.counters["p50_us"] = percentile(latencies, 0.50);
+  state.counters["p90_us"] = percentile(latencies, 0.90);
+  state.counters["p99_us"] = percentile(latencies, 0.99);
+  state.counters["p999_us"] = percentile(latencies, 0.999);
+}
+
+// args: tree size, threshold
+static void BM_Query(benchmark::State& state) {
+  auto& tree = Environment::instance().tree(state.range(0));
+  auto threshold = static_cast<std::uint32_t>(state.range(1));
+
+  latencyCounters(state, tree, threshold);
+  sampleCounters(state, tree, threshold);
+}
+
+// args: tree size, threshold, the cache is kept across the runs of one size and warmed by their queries
+static void BM_CachedQuery(benchmark::State& state) {
+  auto& environment = Environment::instance();
+  auto& tree = environment.cachedTree(state.range(0));
+  auto threshold = static_cast<std::uint32_t>(state.range(1));
+
+  auto before = tree.cache().stats();
+  latencyCounters(state, tree, threshold);
+  auto after = tree.cache().stats();
+
+  auto hits = after.hits - before.hits;
+  auto misses = after.misses - before.misses;
+  state.counters["cache_hit_ratio"] = hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0;
+  state.counters["cache_bytes"] = static_cast<double>(after.bytes);
+
+  sampleCounters(state, tree, threshold);
+}
+
+// args: tree size, each iteration inserts one new dictionary key
+static void BM_Insert(benchmark::State& state) {
+  auto& environment = Environment::instance();
+  auto& tree = environment.tree(state.range(0));
+  const auto& generator = environment.generator();
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto key = generator.key(environment.nextKeyIndex());
+    auto value = DatasetGenerator::value(key);
+    state.ResumeTiming();
+
+    tree.insert(key, value);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+static std::vector<std::int64_t> parseSizes(const std::string& sizes) {
+  std::vector<std::int64_t> parsed;
+  std::istringstream in{ sizes };
+
+  for (std::string size; std::getline(in, size, ','); ) {
+    parsed.push_back(std::stoll(size));
+  }
+
+  return parsed;
+}
+
+int main(int argc, char *argv[]) {
+  benchmark::Initialize(&argc, argv);
+
+  std::vector<std::int64_t> sizes{ 10000, 100000, 1000000, 10000000 };
+  std::string directory = "/tmp";
+
+  for (int i = 1; i != argc; ++i) {
+    std::string arg = argv[i];
+
+    if (0 == arg.compare(0, 8, "--sizes=")) {
+      sizes = parseSizes(arg.substr(8));
+    } else if (0 == arg.compare(0, 12, "--directory=")) {
+      directory = arg.substr(12);
+    } else {
+      std::cerr << "unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  Environment::instance().setDirectory(directory);
+
+  // every benchmark of one size runs before the next size is loaded, inserts last
+  for (auto size : sizes) {
+    for (std::int64_t threshold : { 1, 2, 3 }) {
+      benchmark::RegisterBenchmark("BM_Query", BM_Query)->Args({ size, threshold })->Unit(benchmark::kMicrosecond);
+    }
+
+    for (std::int64_t threshold : { 1, 2, 3 }) {
+      benchmark::RegisterBenchmark("BM_CachedQuery", BM_CachedQuery)->Args({ size, threshold })->Unit(benchmark::kMicrosecond);
+    }
+
+    benchmark::RegisterBenchmark("BM_Insert", BM_Insert)->Arg(size)->Unit(benchmark::kMicrosecond);
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef COUNTING_STORAGE_H
+#define COUNTING_STORAGE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <utility>
+
+#include "StoragePolicy.h"
+
+//
+// StoragePolicy forwarding to another one and counting its reads, see StoragePolicy.h
+//
+template<typename InnerStorage>
+class CountingStorage {
+public:
+  using Snapshot = typename InnerStorage::Snapshot;
+  using WriteBatch = typename InnerStorage::WriteBatch;
+
+private:
+  std::shared_ptr<InnerStorage> _inner;
+
+  // keys looked up by get and multiGet
+  std::atomic<std::uint64_t> _reads;
+  // get and multiGet calls
+  std::atomic<std::uint64_t> _calls;
+
+public:
+  static std::shared_ptr<CountingStorage> open(const std::string& path) {
+    return std::make_shared<CountingStorage>(InnerStorage::open(path));
+  }
+
+  template<typename Options>
+  static std::shared_ptr<CountingStorage> open(const std::string& path, const Options& options) {
+    return std::make_shared<CountingStorage>(InnerStorage::open(path, options));
+  }
+
+  explicit CountingStorage(const std::shared_ptr<InnerStorage>& inner)
+    : _inner{ inner }
+    , _reads{ 0 }
+    , _calls{ 0 }
+  {}
+
+  InnerStorage& inner() {
+    return *_inner;
+  }
+
+  std::uint64_t reads() const {
+    return _reads.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t calls() const {
+    return _calls.load(std::memory_order_relaxed);
+  }
+
+public:
+  bool get(const Snapshot& snapshot, const std::string& key, std::string& value) {
+    _reads.fetch_add(1, std::memory_order_relaxed);
+    _calls.fetch_add(1, std::memory_order_relaxed);
+
+    return _inner->get(snapshot, key, value);
+  }
+
+  void multiGet(const Snapshot& snapshot, const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found) {
+    _reads.fetch_add(keys.size(), std::memory_order_relaxed);
+    _calls.fetch_add(1, std::memory_order_relaxed);
+
+    _inner->multiGet(snapshot, keys, values, found);
+  }
+
+  void write(WriteBatch& batch) {
+    _inner->write(batch);
+  }
+
+  Snapshot snapshot() {
+    return _inner->snapshot();
+  }
+
+  void release(const Snapshot& snapshot) {
+    _inner->release(snapshot);
+  }
+
+  template<typename Callable>
+  void scan(const Snapshot& snapshot, const std::string& prefix, Callable&& callable) {
+    _inner->scan(snapshot, prefix, std::forward<Callable>(callable));
+  }
+};
+
+#endif // COUNTING_STORAGE_H
@@ -0,0 +1,180 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef DATASET_GENERATOR_H
+#define DATASET_GENERATOR_H
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+//
+// reproducible synthetic dictionary and query keys
+//  the i-th dictionary key depends on the seed and i only, so any size is generated in chunks without keeping it
+//  key lengths follow a binomial distribution and letters a Zipfian one, like words of a natural language
+//  query keys pick dictionary keys by Zipfian rank, popular keys come first, and inject typos into them
+//
+class DatasetGenerator {
+public:
+  struct Options {
+    std::uint64_t seed = 2016;
+
+    std::size_t minLength = 3;
+    std::size_t maxLength = 24;
+    // mean length is minLength + (maxLength - minLength) * lengthSkew
+    double lengthSkew = 0.25;
+
+    // exponent of the letter frequencies
+    double letterExponent = 1.0;
+    // exponent of the query key popularity
+    double queryExponent = 0.99;
+
+    // every query key gets one more typo with this probability, up to maxTypos
+    double typoRate = 0.5;
+    std::size_t maxTypos = 3;
+  };
+
+private:
+  Options _options;
+  // cumulative letter frequencies, normalized
+  std::vector<double> _letters;
+
+public:
+  DatasetGenerator()
+    : DatasetGenerator{ Options{} }
+  {}
+
+  explicit DatasetGenerator(const Options& options)
+    : _options{ options }
+    , _letters{ cumulativeLetters(options.letterExponent) }
+  {}
+
+  const Options& options() const {
+    return _options;
+  }
+
+  std::string key(std::uint64_t i) const {
+    std::mt19937_64 rng{ mix(_options.seed, i) };
+    std::binomial_distribution<std::size_t> length{ _options.maxLength - _options.minLength, _options.lengthSkew };
+
+    std::string key(_options.minLength + length(rng), '\0');
+    for (auto& c : key) {
+      c = letter(rng);
+    }
+
+    return key;
+  }
+
+  static std::string value(const std::string& key) {
+    return "v" + key;
+  }
+
+  // dictionary pairs of [first, last)
+  std::vector<std::pair<std::string, std::string>> keyValues(std::uint64_t first, std::uint64_t last) const {
+    std::vector<std::pair<std::string, std::string>> keyValues;
+    keyValues.reserve(last - first);
+
+    for (auto i = first; i != last; ++i) {
+      auto k = key(i);
+      keyValues.emplace_back(k, value(k));
+    }
+
+    return keyValues;
+  }
+
+  // query keys against a dictionary of `size` keys
+  std::vector<std::string> queries(std::uint64_t size, std::size_t count) const {
+    std::mt19937_64 rng{ mix(~_options.seed, size) };
+    std::uniform_real_distribution<double> uniform;
+
+    std::vector<std::string> queries;
+    queries.reserve(count);
+
+    for (std::size_t n = 0; n != count; ++n) {
+      auto query = key(zipfianRank(size, uniform(rng)));
+
+      for (std::size_t typos = 0; typos != _options.maxTypos && uniform(rng) < _options.typoRate; ++typos) {
+        injectTypo(query, rng);
+      }
+
+      queries.push_back(std::move(query));
+    }
+
+    return queries;
+  }
+
+private:
+  // approximate inverse of the continuous Zipfian CDF over ranks [0, size)
+  std::uint64_t zipfianRank(std::uint64_t size, double u) const {
+    const double s = _options.queryExponent;
+    const double n = static_cast<double>(size);
+
+    double rank = std::abs(s - 1.0) < 1e-9 ? std::exp(u * std::log(n)) : std::pow((std::pow(n, 1.0 - s) - 1.0) * u + 1.0, 1.0 / (1.0 - s));
+    return std::min<std::uint64_t>(size - 1, static_cast<std::uint64_t>(rank) - 1);
+  }
+
+  void injectTypo(std::string& key, std::mt19937_64& rng) const {
+    auto typo = letter(rng);
+    auto position = key.empty() ? 0 : rng() % key.size();
+
+    switch (key.size() < 2 ? 1 : rng() % 4) {
+      case 0:
+        key[position] = typo;
+        break;
+
+      case 1:
+        key.insert(key.begin() + position, typo);
+        break;
+
+      case 2:
+        key.erase(key.begin() + position);
+        break;
+
+      default:
+        std::swap(key[position], key[(position + 1) % key.size()]);
+        break;
+    }
+  }
+
+  char letter(std::mt19937_64& rng) const {
+    auto u = std::uniform_real_distribution<double>{}(rng);
+    auto rank = std::upper_bound(_letters.begin(), _letters.end(), u) - _letters.begin();
+
+    return static_cast<char>('a' + std::min<std::ptrdiff_t>(rank, 25));
+  }
+
+  static std::vector<double> cumulativeLetters(double exponent) {
+    std::vector<double> cumulative;
+    double total = 0;
+
+    for (int rank = 1; rank <= 26; ++rank) {
+      total += 1.0 / std::pow(rank, exponent);
+      cumulative.push_back(total);
+    }
+
+    for (auto& c : cumulative) {
+      c /= total;
+    }
+
+    return cumulative;
+  }
+
+  static std::uint64_t mix(std::uint64_t seed, std::uint64_t i) {
+    // splitmix64 finalizer
+    auto z = seed + 0x9e3779b97f4a7c15ULL * (i + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+};
+
+#endif // DATASET_GENERATOR_H
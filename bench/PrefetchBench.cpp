@@ -0,0 +1,112 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "LevenshteinDistance.h"
+#include "WorkStealingPool.h"
+#include "BKTree.h"
+
+//
+// latency percentiles of the synchronous query against prefetched queries of several depths
+// the indexes get a small block cache, so most node reads miss it like an index much larger than memory
+//
+// PrefetchBench [keys] [queries] [threshold] [directory] [threads]
+//
+
+using Tree = BKTree<LevenshteinDistancePolicy>;
+using Options = LevelDBStorage::Options;
+
+static std::string randomKey(std::mt19937& rng) {
+  std::string key(4 + rng() % 9, '\0');
+  for (auto& c : key) {
+    c = static_cast<char>('a' + rng() % 26);
+  }
+
+  return key;
+}
+
+static double microsecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double percentile(std::vector<double> latencies, double rank) {
+  std::sort(latencies.begin(), latencies.end());
+  return latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(rank * latencies.size()))];
+}
+
+int main(int argc, char *argv[]) {
+  std::size_t keyCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+  std::size_t queryCount = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000;
+  std::uint32_t threshold = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 2;
+  std::string directory = argc > 4 ? argv[4] : "/tmp";
+  std::size_t threads = argc > 5 ? std::strtoul(argv[5], nullptr, 10) : 4;
+
+  std::mt19937 rng{ 2016 };
+  std::vector<std::pair<std::string, std::string>> keyValues;
+  for (std::size_t i = 0; i != keyCount; ++i) {
+    auto key = randomKey(rng);
+    keyValues.emplace_back(key, std::string(100, 'v') + key);
+  }
+
+  std::vector<std::string> queries;
+  for (std::size_t i = 0; i != queryCount; ++i) {
+    queries.push_back(randomKey(rng));
+  }
+
+  auto path = directory + "/bktree_prefetch_bench";
+  leveldb::DestroyDB(path, leveldb::Options());
+  leveldb::DestroyDB(path + "_i", leveldb::Options());
+
+  {
+    std::unique_ptr<Tree> tree{ Tree::New(path, path + "_i") };
+    tree->bulkLoad(keyValues.begin(), keyValues.end());
+  }
+
+  auto indexes = Options::indexes(Options::sharedCache(1 << 20));
+  std::unique_ptr<Tree> tree{ Tree::New(path, path + "_i", Options::values(), indexes) };
+  WorkStealingPool pool{ threads };
+
+  std::cout << std::left << std::setw(16) << "mode" << std::right << std::setw(12) << "mean us" << std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "results" << std::endl;
+
+  // depth 0 is the synchronous query
+  for (std::size_t depth : { 0, 1, 2, 4, 8 }) {
+    std::vector<double> latencies;
+    std::size_t results = 0;
+
+    for (const auto& query : queries) {
+      auto start = std::chrono::steady_clock::now();
+      results += 0 == depth ? tree->query(query, threshold, static_cast<std::uint32_t>(-1)).size()
+                            : tree->queryPrefetched(query, threshold, static_cast<std::uint32_t>(-1), pool, depth).size();
+      latencies.push_back(microsecondsSince(start));
+    }
+
+    double total = 0;
+    for (auto latency : latencies) {
+      total += latency;
+    }
+
+    auto mode = 0 == depth ? std::string{"synchronous"} : "depth " + std::to_string(depth);
+    std::cout << std::left << std::setw(16) << mode << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << total / latencies.size() << std::setw(12) << percentile(latencies, 0.5) << std::setw(12) << percentile(latencies, 0.99) << std::setw(12) << results << std::endl;
+  }
+
+  tree.reset();
+  leveldb::DestroyDB(path, leveldb::Options());
+  leveldb::DestroyDB(path + "_i", leveldb::Options());
+
+  return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include <benchmark/benchmark.h>
+
+#include "LevenshteinDistance.h"
+#include "BKTree.h"
+
+#include "DatasetGenerator.h"
+
+//
+// load and query time of one tree per storage setting
+//
+// StorageOptionsBench [benchmark flags] [--size=100000] [--directory=/tmp]
+//
+// BM_Load writes the DatasetGenerator dictionary into fresh databases of a setting,
+// BM_Query reopens them so reads go through tables and runs the same queries for every setting
+//
+
+using Tree = BKTree<LevenshteinDistancePolicy>;
+using Options = LevelDBStorage::Options;
+
+// keys generated and written per bulk load call
+static constexpr std::uint64_t LoadChunkSize = 1 << 20;
+// queries run by each query benchmark, in order, again from the first when the iterations go beyond
+static constexpr std::size_t QueryCount = 10000;
+
+struct Setting {
+  std::string name;
+  Options values;
+  Options indexes;
+};
+
+static const std::vector<Setting>& settings() {
+  static const std::vector<Setting> settings = []() {
+    std::vector<Setting> settings;
+    settings.push_back(Setting{ "defaults", Options{}, Options{} });
+
+    {
+      auto cache = Options::sharedCache(64 << 20);
+      Options values;
+      values.blockCache = cache;
+      Options indexes;
+      indexes.blockCache = cache;
+      settings.push_back(Setting{ "shared 64MB cache", values, indexes });
+    }
+
+    {
+      Options indexes;
+      indexes.bloomBitsPerKey = 10;
+      settings.push_back(Setting{ "index bloom filter", Options{}, indexes });
+    }
+
+    {
+      Options values;
+      values.fillCache = false;
+      settings.push_back(Setting{ "values skip cache", values, Options{} });
+    }
+
+    {
+      Options values;
+      values.compression = leveldb::kNoCompression;
+      Options indexes;
+      indexes.compression = leveldb::kNoCompression;
+      settings.push_back(Setting{ "no compression", values, indexes });
+    }
+
+    {
+      Options values;
+      values.writeBufferSize = 64 << 20;
+      Options indexes;
+      indexes.writeBufferSize = 64 << 20;
+      settings.push_back(Setting{ "64MB write buffer", values, indexes });
+    }
+
+    {
+      auto cache = Options::sharedCache(64 << 20);
+      settings.push_back(Setting{ "values() + indexes()", Options::values(cache), Options::indexes(cache) });
+    }
+
+    return settings;
+  }();
+
+  return settings;
+}
+
+//
+// databases of every setting on disk, with the dictionary size each one holds
+//
+class Environment {
+private:
+  std::string _directory;
+  DatasetGenerator _generator;
+  std::map<std::size_t, std::uint64_t> _loaded;
+
+public:
+  static Environment& instance() {
+    static Environment environment;
+    return environment;
+  }
+
+  void setDirectory(const std::string& directory) {
+    _directory = directory;
+  }
+
+  const DatasetGenerator& generator() const {
+    return _generator;
+  }
+
+  std::string path(std::size_t setting) const {
+    return _directory + "/bktree_options_bench_" + std::to_string(setting);
+  }
+
+  void load(std::size_t setting, std::uint64_t size) {
+    destroy(setting);
+
+    const auto& options = settings()[setting];
+    std::unique_ptr<Tree> tree{ Tree::New(path(setting), path(setting) + "_i", options.values, options.indexes) };
+
+    for (std::uint64_t first = 0; first < size; first += LoadChunkSize) {
+      auto keyValues = _generator.keyValues(first, std::min(size, first + LoadChunkSize));
+      tree->bulkLoad(keyValues.begin(), keyValues.end());
+    }
+
+    _loaded[setting] = size;
+  }
+
+  std::unique_ptr<Tree> open(std::size_t setting, std::uint64_t size) {
+    auto found = _loaded.find(setting);
+    if (found == _loaded.end() || found->second != size)
+      load(setting, size);
+
+    const auto& options = settings()[setting];
+    return std::unique_ptr<Tree>{ Tree::New(path(setting), path(setting) + "_i", options.values, options.indexes) };
+  }
+
+  void destroy(std::size_t setting) {
+    leveldb::DestroyDB(path(setting), leveldb::Options());
+    leveldb::DestroyDB(path(setting) + "_i", leveldb::Options());
+
+    _loaded.erase(setting);
+  }
+};
+
+// args: setting, tree size
+static void BM_Load(benchmark::State& state) {
+  auto& environment = Environment::instance();
+
+  for (auto _ : state) {
+    environment.load(state.range(0), state.range(1));
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(1));
+  state.SetLabel(settings()[state.range(0)].name);
+}
+
+// args: setting, tree size, threshold
+static void BM_Query(benchmark::State& state) {
+  auto& environment = Environment::instance();
+  auto tree = environment.open(state.range(0), state.range(1));
+  auto threshold = static_cast<std::uint32_t>(state.range(2));
+
+  auto queries = environment.generator().queries(state.range(1), QueryCount);
+  std::size_t results = 0;
+  std::size_t i = 0;
+
+  for (auto _ : state) {
+    results += tree->query(queries[i], threshold, static_cast<std::uint32_t>(-1)).size();
+    i = (i + 1) % queries.size();
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(settings()[state.range(0)].name);
+  state.counters["results_per_query"] = static_cast<double>(results) / std::max<std::size_t>(1, state.iterations());
+}
+
+int main(int argc, char *argv[]) {
+  benchmark::Initialize(&argc, argv);
+
+  std::int64_t size = 100000;
+  std::string directory = "/tmp";
+
+  for (int i = 1; i != argc; ++i) {
+    std::string arg = argv[i];
+
+    if (0 == arg.compare(0, 7, "--size=")) {
+      size = std::stoll(arg.substr(7));
+    } else if (0 == arg.compare(0, 12, "--directory=")) {
+      directory = arg.substr(12);
+    } else {
+      std::cerr << "unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  Environment::instance().setDirectory(directory);
+
+  // every setting is loaded once, then queried
+  for (std::int64_t setting = 0; setting != static_cast<std::int64_t>(settings().size()); ++setting) {
+    benchmark::RegisterBenchmark("BM_Load", BM_Load)->Args({ setting, size })->Iterations(1)->Unit(benchmark::kMillisecond);
+
+    for (std::int64_t threshold : { 1, 2, 3 }) {
+      benchmark::RegisterBenchmark("BM_Query", BM_Query)->Args({ setting, size, threshold })->Unit(benchmark::kMicrosecond);
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  for (std::size_t setting = 0; setting != settings().size(); ++setting) {
+    Environment::instance().destroy(setting);
+  }
+
+  return 0;
+}
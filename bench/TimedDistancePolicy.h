@@ -0,0 +1,102 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef TIMED_DISTANCE_POLICY_H
+#define TIMED_DISTANCE_POLICY_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "DistancePolicyTraits.h"
+
+//
+// DistancePolicy forwarding every form the other one has, see DistancePolicyTraits.h
+// while enabled, calls and the time spent in them are counted, the clock reads are part of that time
+//
+template<typename InnerDistancePolicy>
+class TimedDistancePolicy {
+public:
+  struct Counters {
+    // keys whose distances were computed
+    std::uint64_t distances;
+    std::uint64_t nanoseconds;
+  };
+
+private:
+  struct State {
+    std::atomic<bool> enabled{ false };
+    std::atomic<std::uint64_t> distances{ 0 };
+    std::atomic<std::uint64_t> nanoseconds{ 0 };
+  };
+
+  static State& state() {
+    static State state;
+    return state;
+  }
+
+  template<typename Callable>
+  static auto timed(std::uint64_t distances, Callable&& callable) -> decltype(callable()) {
+    auto& counters = state();
+    if (!counters.enabled.load(std::memory_order_relaxed))
+      return callable();
+
+    struct Elapsed {
+      State& counters;
+      std::uint64_t distances;
+      std::chrono::steady_clock::time_point start;
+
+      ~Elapsed() {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        counters.distances.fetch_add(distances, std::memory_order_relaxed);
+        counters.nanoseconds.fetch_add(static_cast<std::uint64_t>(elapsed), std::memory_order_relaxed);
+      }
+    } elapsed{ counters, distances, std::chrono::steady_clock::now() };
+
+    return callable();
+  }
+
+public:
+  static void enable(bool enabled) {
+    state().enabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  static Counters counters() {
+    return Counters{ state().distances.load(std::memory_order_relaxed), state().nanoseconds.load(std::memory_order_relaxed) };
+  }
+
+  static void reset() {
+    state().distances.store(0, std::memory_order_relaxed);
+    state().nanoseconds.store(0, std::memory_order_relaxed);
+  }
+
+  template<typename Inner = InnerDistancePolicy>
+  static auto prepare(const std::string& queryKey) -> decltype(Inner::prepare(queryKey)) {
+    return timed(0, [&]() { return Inner::prepare(queryKey); });
+  }
+
+  // `key` is a string or a prepared pattern
+  template<typename Key>
+  static auto distance(const Key& key, const std::string& other) -> decltype(InnerDistancePolicy::distance(key, other)) {
+    return timed(1, [&]() { return InnerDistancePolicy::distance(key, other); });
+  }
+
+  template<typename Key>
+  static auto distance(const Key& key, const std::string& other, std::uint32_t maxDistance) -> decltype(InnerDistancePolicy::distance(key, other, maxDistance)) {
+    return timed(1, [&]() { return InnerDistancePolicy::distance(key, other, maxDistance); });
+  }
+
+  template<typename Pattern>
+  static auto distance(const Pattern& pattern, const std::vector<std::string>& keys, const std::vector<std::uint32_t>& maxDistances, std::vector<std::uint32_t>& distances) -> decltype(InnerDistancePolicy::distance(pattern, keys, maxDistances, distances)) {
+    return timed(keys.size(), [&]() { return InnerDistancePolicy::distance(pattern, keys, maxDistances, distances); });
+  }
+};
+
+#endif // TIMED_DISTANCE_POLICY_H
@@ -9,387 +9,2005 @@
 #ifndef BKTREE_H
 #define BKTREE_H
 
-#include <leveldb/db.h>
-#include <leveldb/write_batch.h>
-
 #include <string>
 #include <set>
+#include <map>
+#include <vector>
 #include <queue>
+#include <deque>
+#include <iterator>
+#include <functional>
 #include <memory>
 #include <algorithm>
 #include <type_traits>
 #include <tuple> 
+#include <stdexcept>
+#include <limits>
+#include <mutex>
+#include <exception>
+#include <condition_variable>
+#include <atomic>
+#include <future>
 
 #include "OverwriteRootKeyPolicy.h"
 #include "CachePolicy.h"
 #include "ChildrenKeyPolicy.h"
+#include "DistancePolicyTraits.h"
+#include "WorkStealingPool.h"
+#include "PinnedNodes.h"
+#include "NodeRecord.h"
+#include "KeyTraits.h"
+#include "StatsPolicy.h"
+#include "LevelDBStorage.h"
 
 template<typename DistancePolicy, 
          typename CachePolicy = NoCachePolicy, 
-         typename ChildrenKeyPolicy = DisableChildrenKey>
+         typename ChildrenKeyPolicy = DisableChildrenKey,
+         typename StoragePolicy = LevelDBStorage,
+         typename KeyTraits = VariableKeyTraits,
+         typename StatsPolicy = NoStatsPolicy>
 class BKTree {
 
   // 
-  // each index node contains one children distances key and several child index keys
-  // the value queried by children distances key would be a list of distances and 
-  // each child index key (via CHILD_INDEX_KEY by putting parent key and the distance between them) paired with one or more real keys
+  // each index node is one record holding the distances and keys of all its children, see NodeRecord
+  // one read per node gives everything a traversal needs to pick the children to visit
   //
   // [real key] -> [value]
-  // [children distances key] -> [distances ...]
-  // [real key] + [distance] -> [child index key]
-  // [child index key] -> [real keys ...]
+  // [node key] -> [children distances ...] [children keys ...]
+  //
+  // ChildrenKeyPolicy is kept for compatibility only, node records always carry the children keys
+  // both storages are of StoragePolicy, see StoragePolicy.h
+  //
+  // KeyTraits fixes the length of the keys, see KeyTraits.h
+  // traversals keep their pending keys in one flat buffer and reuse the strings of visited keys and node keys
+  //
+  // StatsPolicy records the reads, distances and pruning of query(), queryStream() and queryPrefetched(), see StatsPolicy.h
+  //
+  // values and indexes may share one storage, values are then kept under VALUE_KEY
+  // and every write commits the values and indexes it changes as one batch
   //
 
 private:
-  using SelfType = BKTree<DistancePolicy, CachePolicy, ChildrenKeyPolicy>;
-  using Storage = leveldb::DB;
+  using SelfType = BKTree<DistancePolicy, CachePolicy, ChildrenKeyPolicy, StoragePolicy, KeyTraits, StatsPolicy>;
+  using Recorder = typename StatsPolicy::Recorder;
+  using Storage = StoragePolicy;
+  using Snapshot = typename Storage::Snapshot;
+
+  // number of pending keys whose distances are computed in one call
+  static constexpr std::size_t QueryBatchSize = 16;
+  // number of nodes of one level whose records are read together by queryBatch
+  static constexpr std::size_t SharedNodesBatchSize = 256;
+
+  class ReadView;
 
 private:
   // user input key-values
   std::shared_ptr<Storage> _valuesStorage;
   // BKTree indexes
   std::shared_ptr<Storage> _indexesStorage;
-  std::string _rootKey;
+  // both are the same storage
+  const bool _singleStorage;
+
+  const PinOptions _pinOptions;
+
+  // serializes writers
+  std::mutex _writeMutex;
 
   CachePolicy _cachePolicy;
+  // guards cache updates and invalidations and publishing views, and every cache access unless the cache is concurrent
+  std::mutex _cacheMutex;
+
+  StatsPolicy _statsPolicy;
+
+  // the tree as of the last write, replaced as a whole by the writer and loaded once per traversal
+  std::shared_ptr<const ReadView> _view;
 
 private:
-  class ChildrenIterator : public std::iterator<std::input_iterator_tag, std::uint32_t> {
+  // buffers of the batched storage reads of one traversal
+  struct BatchReads {
+    std::vector<std::size_t> slots;
+    std::vector<std::string> keys;
+    std::vector<std::string> records;
+    std::vector<bool> found;
+
+    // strings dropped from keys, kept with their capacity
+    std::vector<std::string> spareKeys;
+
+    void resizeKeys(std::size_t size) {
+      for (; keys.size() > size; keys.pop_back()) {
+        spareKeys.push_back(std::move(keys.back()));
+      }
+
+      for (; keys.size() < size; spareKeys.pop_back()) {
+        if (spareKeys.empty()) {
+          keys.resize(size);
+          break;
+        }
+
+        keys.push_back(std::move(spareKeys.back()));
+      }
+    }
+  };
+
+  // pending keys of one radius traversal and the buffers reused by its batches
+  struct Traversal {
+    KeyQueue<KeyTraits> pendingKeys;
+
+    // keys dequeued together get their distances in one batch
+    std::vector<std::string> currentKeys;
+    std::vector<const PinnedNodes::Node *> currentNodes;
+    std::vector<NodeChildren> children;
+    std::vector<std::uint32_t> bounds;
+    std::vector<std::uint32_t> keyDistances;
+    BatchReads reads;
+    Recorder stats;
+
+    explicit Traversal(const ReadView& view) {
+      if (!view.rootKey.empty())
+        pendingKeys.push(view.rootKey);
+    }
+  };
+
+  // keys of one batch and their records, read by an executor task
+  struct PrefetchedBatch {
+    std::vector<std::string> keys;
+    std::vector<const PinnedNodes::Node *> nodes;
+    std::vector<NodeChildren> children;
+    BatchReads reads;
+    // gets of the task, merged into the traversal once read
+    Recorder stats;
+
+    std::promise<void> loaded;
+    std::future<void> ready;
+  };
+
+  //
+  // batches of pending keys being read on an executor, in the order they were taken from the pending keys
+  // batches still being read are waited for on destruction, their tasks read the storages of the tree
+  //
+  template<typename Executor>
+  class Prefetcher {
   private:
-    std::size_t _offset;
-    const std::string *_children;
+    SelfType& _tree;
+    const std::shared_ptr<const ReadView> _view;
+    Executor& _executor;
+    const std::size_t _depth;
+
+    std::deque<std::shared_ptr<PrefetchedBatch>> _batches;
 
   public:
-    ChildrenIterator(const std::string& children, std::size_t offset)
-      : _offset{ offset }
-      , _children{ &children }
+    Prefetcher(SelfType& tree, const std::shared_ptr<const ReadView>& view, Executor& executor, std::size_t depth)
+      : _tree{ tree }
+      , _view{ view }
+      , _executor{ executor }
+      , _depth{ std::max<std::size_t>(depth, 1) }
     {}
 
-    std::tuple<std::size_t, std::size_t> pos() {
-      return std::make_tuple(_offset * sizeof(std::uint32_t), _offset);
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator = (const Prefetcher&) = delete;
+
+    ~Prefetcher() {
+      for (const auto& batch : _batches) {
+        batch->ready.wait();
+      }
     }
 
-    ChildrenIterator& operator ++() {
-      ++_offset;
-      return *this;
+    bool empty() const {
+      return _batches.empty();
     }
 
-    std::uint32_t operator *() {
-      return Helper::parse(_children->substr(_offset * sizeof(std::uint32_t), sizeof(std::uint32_t)));
+    // takes batches of pending keys until `depth` batches are in flight, a last smaller batch only if `partial`
+    void fill(KeyQueue<KeyTraits>& pendingKeys, bool partial) {
+      while (_batches.size() < _depth && (pendingKeys.size() >= QueryBatchSize || (partial && !pendingKeys.empty()))) {
+        auto batch = std::make_shared<PrefetchedBatch>();
+        batch->ready = batch->loaded.get_future();
+
+        bool pinned = true;
+        while (!pendingKeys.empty() && batch->keys.size() != QueryBatchSize) {
+          batch->keys.emplace_back();
+          pendingKeys.pop(batch->keys.back());
+
+          batch->nodes.push_back(_view->pinnedNodes->find(batch->keys.back()));
+          pinned = pinned && batch->nodes.back();
+        }
+
+        batch->children.resize(batch->keys.size());
+        _batches.push_back(batch);
+
+        if (pinned) {
+          batch->loaded.set_value();
+          continue;
+        }
+
+        auto& tree = _tree;
+        auto view = _view;
+        try {
+          _executor.submit([&tree, view, batch]() {
+            try {
+              tree.readRecords(*view, batch->keys, batch->nodes, batch->children, batch->reads, batch->stats);
+              batch->loaded.set_value();
+            } catch (...) {
+              batch->loaded.set_exception(std::current_exception());
+            }
+          });
+        } catch (...) {
+          // a batch never submitted is never loaded, nothing waits for it
+          batch->loaded.set_exception(std::current_exception());
+          throw;
+        }
+      }
     }
 
-    bool operator == (const ChildrenIterator& i) const { return _offset == i._offset; }
-    bool operator != (const ChildrenIterator& i) const { return _offset != i._offset; }
-  };
+    // the oldest batch once read, rethrows its read error
+    std::shared_ptr<PrefetchedBatch> next() {
+      auto batch = std::move(_batches.front());
+      _batches.pop_front();
 
-  static std::string LoadRootKey(leveldb::DB* indexesDB) {
-    std::string queryValue;
-    auto status = indexesDB->Get(leveldb::ReadOptions(), ROOT_INDEX_KEY, &queryValue);
-    if (status.ok()) {
-      return queryValue;
-      
-    } else if (status.IsNotFound()) {
-      return std::string{};
+      batch->ready.get();
+      return batch;
     }
+  };
 
-    throw std::runtime_error{status.ToString()}; 
-  }
-  
-public:
-  static SelfType* New(const std::string& path, const std::string& indexStoragePath) {
-    leveldb::DB* db = nullptr;
-    leveldb::DB* indexesDB = nullptr;
+  //
+  // writes of one insertion round are kept in memory and flushed as one values batch and one indexes batch
+  // indexes lookups during the round hit the pending indexes first, so later keys can be placed under earlier ones
+  //
+  struct PendingWrites {
+    std::map<std::string, std::string> values;
+    // root and tombstone records
+    std::map<std::string, std::string> indexes;
+    // node records by real key
+    std::map<std::string, NodeRecord> nodes;
+    // nodes which got new children
+    std::set<std::string> parents;
+
+    // removed unless written again in the same round
+    std::set<std::string> erasedValues;
+    std::set<std::string> erasedIndexes;
+    std::set<std::string> erasedNodes;
+    // keys whose tombstones are dropped
+    std::set<std::string> buried;
+    // nodes are removed or moved, caches unable to invalidate single parents are cleared
+    bool reshaped = false;
+
+    // replaces the current root key when set
+    bool rootChanged = false;
+    std::string root;
+  };
 
-    leveldb::Options options;
-    options.create_if_missing = true;
+  //
+  // root key, pinned nodes, tombstones and snapshots of both storages, taken by the writer after each write
+  // a traversal reads through one view so it sees one consistent tree while a writer is inserting or compacting
+  //
+  class ReadView {
+  public:
+    const std::string rootKey;
+    const std::shared_ptr<const PinnedNodes> pinnedNodes;
+    const std::shared_ptr<const std::set<std::string>> tombstones;
 
-    auto status = leveldb::DB::Open(options, path, &db);
-    if (status.ok()) {
-      status = leveldb::DB::Open(options, indexStoragePath, &indexesDB);
+  private:
+    Storage *_valuesStorage;
+    Storage *_indexesStorage;
+    const Snapshot _indexesSnapshot;
+    const Snapshot _valuesSnapshot;
 
-      if (status.ok()) {
-        return new SelfType(std::shared_ptr<Storage>{db}, std::shared_ptr<Storage>{indexesDB}, LoadRootKey(indexesDB));
+  public:
+    ReadView(SelfType& tree, const std::string& rootKey, const std::shared_ptr<const PinnedNodes>& pinnedNodes, const std::shared_ptr<const std::set<std::string>>& tombstones)
+      : rootKey{ rootKey }
+      , pinnedNodes{ pinnedNodes }
+      , tombstones{ tombstones }
+      , _valuesStorage{ tree._valuesStorage.get() }
+      , _indexesStorage{ tree._indexesStorage.get() }
+      , _indexesSnapshot{ _indexesStorage->snapshot() }
+      , _valuesSnapshot{ _valuesStorage->snapshot() }
+    {}
 
-      } else {
-        // close db
-        delete db;
-      }
+    ReadView(const ReadView&) = delete;
+    ReadView& operator = (const ReadView&) = delete;
+
+    ~ReadView() {
+      _valuesStorage->release(_valuesSnapshot);
+      _indexesStorage->release(_indexesSnapshot);
     }
 
-    throw std::runtime_error{status.ToString()}; 
-  }
+    const Snapshot& values() const {
+      return _valuesSnapshot;
+    }
 
-protected:
-  BKTree(const std::shared_ptr<Storage>& valuesStorage, const std::shared_ptr<Storage>& indexesStorage, const std::string& rootKey)
-    : _valuesStorage{ valuesStorage }
-    , _indexesStorage{ indexesStorage }
-    , _rootKey{ rootKey }
-  {}
+    const Snapshot& indexes() const {
+      return _indexesSnapshot;
+    }
+  };
 
-public:
-  template<class OverwriteRootKeyPolicy = CleanRootKeyIndexesPolicy>
-  void insert(const std::string& key, const std::string& value) {
-    // if has no root key directly place the first key as root key
-    if (_rootKey.empty()) {
-      storeRootKey<OverwriteRootKeyPolicy>(key, value);
+private:
+  // state shared by the tasks of one parallel query
+  template<typename ResultContainer>
+  struct ParallelQuery {
+    std::shared_ptr<const ReadView> view;
+    QueryDistance<DistancePolicy> queryDistance;
+    std::uint32_t threshold;
+    std::uint32_t limit;
+    std::uint32_t distanceMetrics;
+
+    std::atomic<bool> stopped;
+    std::exception_ptr error;
+
+    // guards values, pending and error
+    std::mutex mutex;
+    std::condition_variable done;
+    ResultContainer values;
+    std::size_t pending;
+
+    ParallelQuery(SelfType& tree, const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics)
+      : view{ std::atomic_load(&tree._view) }
+      , queryDistance{ key }
+      , threshold{ threshold }
+      , limit{ limit }
+      , distanceMetrics{ distanceMetrics }
+      , stopped{ false }
+      , pending{ 0 }
+    {}
+  };
 
-      _rootKey = key;
-      return;
-    }
+public:
+  //
+  // input range over the matches of one radius query, see queryStream
+  //
+  class QueryStream {
+    friend SelfType;
+    struct State;
 
+  public:
+    //
+    // key and distance of one match, the value is read on the first call of value()
+    // matches are read through the stream they came from and must not outlive it
     //
-    std::string currentKey = _rootKey;
+    class Match {
+      friend struct State;
+
+    private:
+      State *_state;
+      std::string _key;
+      std::uint32_t _distance;
+
+      mutable std::string _value;
+      mutable bool _loaded;
+
+    public:
+      Match(State *state, const std::string& key, std::uint32_t distance)
+        : _state{ state }
+        , _key{ key }
+        , _distance{ distance }
+        , _loaded{ false }
+      {}
+
+      const std::string& key() const {
+        return _key;
+      }
 
-    while (true) {
-      // get distance 
-      auto d = DistancePolicy::distance(currentKey, key);
+      std::uint32_t distance() const {
+        return _distance;
+      }
 
-      if (0 == d) {
-        // update value
-        updateValue(key, value);
-        break;
+      const std::string& value() const {
+        if (!_loaded)
+          _state->load(*this);
+
+        return _value;
       }
+    };
 
-      if (!containsAndGet(CHILD_INDEX_KEY(currentKey, d), currentKey)) {
-        // not found
-        storeChild(currentKey, d, key, value);
-        break;
-      } 
-      // continue to search storage point
-    }
-  }
+    class Iterator {
+    private:
+      // null once the matches run out
+      std::shared_ptr<State> _state;
 
-  template<typename ResultContainer = std::set<std::string>>
-  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit) {
-    return query(key, threshold, limit, threshold);
-  }
+    public:
+      using iterator_category = std::input_iterator_tag;
+      using value_type = Match;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const Match *;
+      using reference = const Match&;
 
-  template<typename ResultContainer = std::set<std::string>>
-  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics) {
-    ResultContainer values;
+      Iterator() = default;
 
-    std::queue<std::string> pendingKeys;
-    std::string currentKey = _rootKey;
+      explicit Iterator(const std::shared_ptr<State>& state)
+        : _state{ state && !state->matches.empty() ? state : nullptr }
+      {}
 
-    while (true) {
-      auto d = DistancePolicy::distance(currentKey, key);
+      reference operator * () const {
+        return _state->matches.front();
+      }
 
-      if (d < distanceMetrics) {
-        values.emplace(loadValue(currentKey));
-        if (values.size() >= limit)
-          break;
+      pointer operator -> () const {
+        return &_state->matches.front();
       }
 
-      appendChildrenKeys(_cachePolicy, d, threshold, currentKey, pendingKeys);
+      // the previous match is dropped, references to it are invalidated
+      Iterator& operator ++ () {
+        _state->next();
+        if (_state->matches.empty())
+          _state.reset();
 
-      if (pendingKeys.empty()) {
-        break;
+        return *this;
       }
 
-      currentKey = pendingKeys.front();
-      pendingKeys.pop();
-    }
+      bool operator == (const Iterator& other) const {
+        return _state == other._state;
+      }
 
-    return values;
-  }
+      bool operator != (const Iterator& other) const {
+        return _state != other._state;
+      }
+    };
+
+  private:
+    //
+    // the traversal advances one batch of nodes at a time and keeps the matches of the batch until they are consumed
+    //
+    struct State {
+      SelfType& tree;
+      const std::shared_ptr<const ReadView> view;
+      const std::string key;
+      QueryDistance<DistancePolicy> queryDistance;
+      const std::uint32_t threshold;
+      const std::uint32_t distanceMetrics;
+
+      Traversal traversal;
+      std::deque<Match> matches;
+
+      // buffers of the batched value reads
+      std::vector<std::size_t> slots;
+      std::vector<std::string> valueKeys;
+      std::vector<std::string> values;
+      std::vector<bool> found;
+
+      State(SelfType& tree, const std::string& key, std::uint32_t threshold, std::uint32_t distanceMetrics)
+        : tree{ tree }
+        , view{ std::atomic_load(&tree._view) }
+        , key{ key }
+        , queryDistance{ this->key }
+        , threshold{ threshold }
+        , distanceMetrics{ distanceMetrics }
+        , traversal{ *view }
+      {
+        fill();
+      }
 
-  SelfType* clone(bool sharedCache = false) {
-    auto bktree = new SelfType(_valuesStorage, _indexesStorage, _rootKey);
+      ~State() {
+        tree._statsPolicy.add(traversal.stats);
+      }
 
-    if (sharedCache) {
-      bktree->_cachePolicy = _cachePolicy;
+      void fill() {
+        while (matches.empty() && !traversal.pendingKeys.empty()) {
+          tree.visitBatch(*view, queryDistance, threshold, distanceMetrics, traversal, [this](const std::string& matchedKey, std::uint32_t d) {
+            matches.emplace_back(this, matchedKey, d);
+            return true;
+          });
+        }
+      }
+
+      void next() {
+        matches.pop_front();
+        fill();
+      }
+
+      // values of every buffered match are read together, `match` may be a copy taken out of the buffer
+      void load(const Match& match) {
+        slots.clear();
+        valueKeys.clear();
+
+        for (std::size_t i = 0; i != matches.size(); ++i) {
+          if (!matches[i]._loaded) {
+            slots.push_back(i);
+            valueKeys.push_back(tree.valueKey(matches[i]._key));
+          }
+        }
+
+        if (!valueKeys.empty()) {
+          auto started = traversal.stats.start();
+          tree._valuesStorage->multiGet(view->values(), valueKeys, values, found);
+          traversal.stats.valueGets(valueKeys.size(), started);
+
+          for (std::size_t i = 0; i != slots.size(); ++i) {
+            auto& buffered = matches[slots[i]];
+            if (!found[i])
+              throw std::runtime_error{"no value of key " + buffered._key};
+
+            buffered._value = std::move(values[i]);
+            buffered._loaded = true;
+          }
+        }
+
+        if (!match._loaded) {
+          auto started = traversal.stats.start();
+          match._value = tree.loadValue(view->values(), match._key);
+          match._loaded = true;
+          traversal.stats.valueGets(1, started);
+        }
+      }
+    };
+
+  private:
+    std::shared_ptr<State> _state;
+
+    explicit QueryStream(const std::shared_ptr<State>& state)
+      : _state{ state }
+    {}
+
+  public:
+    // begin() resumes where the last iterator stopped
+    Iterator begin() const {
+      return Iterator{ _state };
     }
 
-    return bktree;
-  }
+    Iterator end() const {
+      return Iterator{};
+    }
+
+    // counters of the stream so far, the tree must record them, see StatsPolicy.h
+    const QueryStats& stats() const {
+      static_assert(!std::is_same<StatsPolicy, NoStatsPolicy>::value, "the tree records no stats");
+      return _state->traversal.stats.stats();
+    }
+  };
 
 private:
-  void updateValue(const std::string& key, const std::string& value) {
-    auto status = _valuesStorage->Put(leveldb::WriteOptions(), key, value);
-    if (!status.ok())
-      throw std::runtime_error{status.ToString()};
-  }
+  static std::string LoadRootKey(Storage& indexesStorage) {
+    std::string queryValue;
+    if (indexesStorage.get(Snapshot{}, ROOT_INDEX_KEY, queryValue)) {
+      return queryValue;
+    }
 
-  template<class OverwritePolicy>
-  void storeRootKey(const std::string& key, const std::string& value) {
-    auto status = _valuesStorage->Put(leveldb::WriteOptions(), key, value);
-    if (!status.ok())
-       throw std::runtime_error{status.ToString()};
+    return std::string{};
+  }
 
-    // overwrite the root key if has children indexes
-    auto distances = childDistances(key, true); // return empty vec if no such index key
+  //
+  // indexes without a version are fresh or in the legacy layout, fresh ones get the current version
+  // indexes are only opened in the layout they were created with, sharing the storage with the values or not
+  //
+  static void CheckIndexFormat(Storage& indexesStorage, bool singleStorage) {
+    std::string version;
+    if (indexesStorage.get(Snapshot{}, FORMAT_VERSION_KEY, version)) {
+      if (version != std::to_string(NodeRecord::FormatVersion))
+        throw std::runtime_error{"unsupported index format version " + version};
 
-    leveldb::WriteBatch batch;
-    // update root index key
-    batch.Put(ROOT_INDEX_KEY, key);
+      std::string marker;
+      if (indexesStorage.get(Snapshot{}, SINGLE_STORAGE_KEY, marker) != singleStorage)
+        throw std::runtime_error{singleStorage ? "indexes without values, open them with a values storage" : "indexes with values, open them as a single storage"};
 
-    if (!distances.empty()) {
-      OverwritePolicy::overwrite(_indexesStorage, key, distances, batch);
-    } else {
-      // create new indexes for the root key  
-      batch.Put(CHILDREN_DISTANCES_KEY(key), leveldb::Slice{});
-      batch.Put(CHILDREN_KEY(key), leveldb::Slice{});
+      return;
     }
 
-    status = _indexesStorage->Write(leveldb::WriteOptions(), &batch);
-    if (!status.ok())
-      throw std::runtime_error{status.ToString()};
-  }
+    if (!LoadRootKey(indexesStorage).empty())
+      throw std::runtime_error{"indexes in the legacy layout, migrate them with IndexMigration first"};
 
-  bool containsAndGet(const std::string& indexKey, std::string& value) {
-    auto status = _indexesStorage->Get(leveldb::ReadOptions(), indexKey, &value);
-    if (status.IsNotFound())
-      return false;
-    else if (status.ok())
-      return true;
+    typename Storage::WriteBatch batch;
+    batch.put(FORMAT_VERSION_KEY, std::to_string(NodeRecord::FormatVersion));
+    if (singleStorage)
+      batch.put(SINGLE_STORAGE_KEY, std::string{});
 
-    throw std::runtime_error{status.ToString()};
+    indexesStorage.write(batch);
   }
 
-  std::string lookupChildKey(const std::string& key, std::uint32_t distance) {
-    return loadIndex(CHILD_INDEX_KEY(key, distance));
+  static std::set<std::string> LoadTombstones(Storage& indexesStorage) {
+    std::set<std::string> tombstones;
+
+    const auto prefix = TOMBSTONE_KEY_PREFIX;
+    indexesStorage.scan(Snapshot{}, prefix, [&tombstones, &prefix](const std::string& key, const std::string&) {
+      tombstones.emplace(key, prefix.size());
+    });
+
+    return tombstones;
+  }
+  
+public:
+  static SelfType* New(const std::string& path, const std::string& indexStoragePath) {
+    return New(path, indexStoragePath, PinOptions{});
   }
 
-  void storeChild(const std::string& parent, std::uint32_t distance, const std::string& key, const std::string& value) {
-    // child distances is a string joined by multi fixed-length substring
-    // and each one represents the distance value in hex format 
+  //
+  // the top levels selected by `pinning` are loaded into memory here
+  // traversals and inserts read them before falling back to the indexes storage
+  //
+  static SelfType* New(const std::string& path, const std::string& indexStoragePath, const PinOptions& pinning) {
+    // closed by the owners on any failure below
+    auto valuesStorage = Storage::open(path);
+    auto indexesStorage = Storage::open(indexStoragePath);
 
-    // get child distances
-    std::string parentsChildren;
-    auto status = _indexesStorage->Get(leveldb::ReadOptions(), CHILDREN_DISTANCES_KEY(parent), &parentsChildren);
+    return New(valuesStorage, indexesStorage, pinning);
+  }
 
-    if (!status.ok())
-      throw std::runtime_error{status.ToString()};
+  //
+  // each storage opened with its own options, for storages with Options, see StoragePolicy.h
+  //
+  template<typename StorageOptions>
+  static SelfType* New(const std::string& path, const std::string& indexStoragePath, const StorageOptions& valuesOptions, const StorageOptions& indexesOptions, const PinOptions& pinning = PinOptions{}) {
+    auto valuesStorage = Storage::open(path, valuesOptions);
+    auto indexesStorage = Storage::open(indexStoragePath, indexesOptions);
 
-    std::uint32_t pos = 0;
-    std::uint32_t logicPos = 0;
-      
-    // find insert position
-    std::tie(pos, logicPos) = findInsertionPos(parentsChildren, distance);
-    // update children
-    parentsChildren.insert(pos, Helper::stringfy(distance));
+    return New(valuesStorage, indexesStorage, pinning);
+  }
 
-    if (!_valuesStorage->Put(leveldb::WriteOptions(), key, value).ok())
-      throw std::runtime_error("store child key-value failed");
+  //
+  // over storages opened by the caller, storages of one tree must not be shared with another unless it is a clone
+  //
+  static SelfType* New(const std::shared_ptr<Storage>& valuesStorage, const std::shared_ptr<Storage>& indexesStorage, const PinOptions& pinning = PinOptions{}) {
+    CheckIndexFormat(*indexesStorage, valuesStorage == indexesStorage);
 
-    leveldb::WriteBatch batch;
-    batch.Put(CHILDREN_DISTANCES_KEY(key), leveldb::Slice{});
-    batch.Put(CHILDREN_DISTANCES_KEY(parent), parentsChildren);
-    batch.Put(CHILD_INDEX_KEY(parent, distance), key);
+    return new SelfType(valuesStorage, indexesStorage, LoadRootKey(*indexesStorage), LoadTombstones(*indexesStorage), pinning);
+  }
 
-    putChildrenKey<ChildrenKeyPolicy>(parent, key, logicPos, batch);
+  //
+  // values and indexes in one storage, each insert, erase or compaction step is a single write
+  //
+  static SelfType* New(const std::string& path, const PinOptions& pinning = PinOptions{}) {
+    return New(Storage::open(path), pinning);
+  }
 
-    status = _indexesStorage->Write(leveldb::WriteOptions(), &batch);
-    if (!status.ok())
-      throw std::runtime_error{status.ToString()};
+  template<typename InputStorage = Storage>
+  static SelfType* New(const std::string& path, const typename InputStorage::Options& options, const PinOptions& pinning = PinOptions{}) {
+    return New(Storage::open(path, options), pinning);
   }
 
-  std::tuple<std::size_t, std::size_t> findInsertionPos(const std::string& children, std::uint32_t distance) {
-    // children is sorted ascendingly
-    return std::lower_bound(ChildrenIterator{children, 0}, 
-                            ChildrenIterator{children, (children.size() / sizeof(std::uint32_t))},
-                            distance).pos();
+  static SelfType* New(const std::shared_ptr<Storage>& storage, const PinOptions& pinning = PinOptions{}) {
+    return New(storage, storage, pinning);
   }
 
-  std::string loadValue(const std::string& key) {
-    std::string queryValue;
-    auto status = _valuesStorage->Get(leveldb::ReadOptions(), key, &queryValue);
-    if (status.ok()) {
-      return queryValue;
+protected:
+  BKTree(const std::shared_ptr<Storage>& valuesStorage, const std::shared_ptr<Storage>& indexesStorage, const std::string& rootKey, const std::set<std::string>& tombstones, const PinOptions& pinning)
+    : _valuesStorage{ valuesStorage }
+    , _indexesStorage{ indexesStorage }
+    , _singleStorage{ valuesStorage == indexesStorage }
+    , _pinOptions{ pinning }
+    , _view{ std::make_shared<const ReadView>(*this, rootKey, pinNodes(rootKey, nullptr, std::set<std::string>{}), std::make_shared<const std::set<std::string>>(tombstones)) }
+  {}
+
+public:
+  //
+  // writers are serialized, readers may run concurrently and see either none or all of one write
+  //
+  template<class OverwriteRootKeyPolicy = CleanRootKeyIndexesPolicy>
+  void insert(const std::string& key, const std::string& value) {
+    checkKey(key);
+
+    std::lock_guard<std::mutex> lock{_writeMutex};
+
+    // if has no root key directly place the first key as root key
+    if (rootKey().empty()) {
+      storeRootKey<OverwriteRootKeyPolicy>(key, value);
+      return;
     }
 
-    throw std::runtime_error{status.ToString()};
+    PendingWrites pending;
+    insertPending(pending, key, value);
+    flush(pending);
   }
 
-  std::string loadIndex(const std::string& key) {
-    std::string queryValue;
-    auto status = _indexesStorage->Get(leveldb::ReadOptions(), key, &queryValue);
-    if (status.ok()) {
-      return queryValue;
-    }
+  //
+  // insert a group of key-values with a single values write and a single indexes write
+  // keys later in the group can be placed under keys earlier in the group
+  //
+  template<class OverwriteRootKeyPolicy = CleanRootKeyIndexesPolicy>
+  void insertBatch(const std::vector<std::pair<std::string, std::string>>& keyValues) {
+    if (keyValues.empty())
+      return;
 
-    throw std::runtime_error{status.ToString()};
+    bulkLoad<OverwriteRootKeyPolicy>(keyValues.begin(), keyValues.end(), keyValues.size());
   }
 
-  std::vector<std::uint32_t> childDistances(const std::string& key, bool notFoundTolerated = false) {
-    std::string queryValue;
+  //
+  // build the tree from a key-value range in chunks of `chunkSize` pairs
+  // each chunk is placed in memory and then written with one values batch and one indexes batch
+  //
+  template<class OverwriteRootKeyPolicy = CleanRootKeyIndexesPolicy, typename InputIterator>
+  void bulkLoad(InputIterator first, InputIterator last, std::size_t chunkSize = 1 << 16) {
+    if (0 == chunkSize)
+      throw std::invalid_argument{"chunk size must be positive"};
 
-    auto status = _indexesStorage->Get(leveldb::ReadOptions(), CHILDREN_DISTANCES_KEY(key), &queryValue);
-    if (status.ok()) {
-      return std::vector<std::uint32_t>{ChildrenIterator{queryValue, 0},
-                                        ChildrenIterator{queryValue, (queryValue.size() / sizeof(std::uint32_t))}};
-    }
+    std::lock_guard<std::mutex> lock{_writeMutex};
 
-    if (notFoundTolerated && status.IsNotFound()) {
-      // return empty one
-      return std::vector<std::uint32_t>{};
+    while (first != last) {
+      PendingWrites pending;
+
+      for (std::size_t n = 0; n != chunkSize && first != last; ++n, ++first) {
+        const auto& keyValue = *first;
+        checkKey(keyValue.first);
+
+        if (rootKey().empty()) {
+          storeRootKey<OverwriteRootKeyPolicy>(keyValue.first, keyValue.second);
+          continue;
+        }
+
+        insertPending(pending, keyValue.first, keyValue.second);
+      }
+
+      flush(pending);
     }
+  }
+
+  //
+  // mark `key` erased, its node keeps routing queries and inserts until compact() removes it
+  // returns false if the key is not stored or already erased
+  //
+  bool erase(const std::string& key) {
+    std::lock_guard<std::mutex> lock{_writeMutex};
 
-    throw std::runtime_error{status.ToString()};
+    auto view = std::atomic_load(&_view);
+    std::vector<std::string> ancestors;
+    std::uint32_t distance = 0;
+
+    if (view->tombstones->count(key) || !locate(key, ancestors, distance))
+      return false;
+
+    typename Storage::WriteBatch batch;
+    batch.put(TOMBSTONE_KEY(key), std::string{});
+    _indexesStorage->write(batch);
+
+    auto tombstones = std::make_shared<std::set<std::string>>(*view->tombstones);
+    tombstones->insert(key);
+    publish(view->rootKey, view->pinnedNodes, std::move(tombstones), std::set<std::string>{});
+
+    return true;
   }
 
-  template<typename InputCachePolicy>
-  std::enable_if_t<std::is_same<InputCachePolicy, NoCachePolicy>::value> appendChildrenKeys(InputCachePolicy& cache, std::uint32_t d, std::uint32_t threshold, const std::string& currentKey, std::queue<std::string>& pendingKeys) {
-    auto distances = childDistances(currentKey);
+  //
+  // detach every erased node whose ancestors are alive and place the live keys of its subtree again
+  // each subtree is written with one indexes batch, its erased index entries and values are deleted
+  // returns the number of erased keys reclaimed
+  //
+  std::size_t compact() {
+    static_assert(canDropCached<CachePolicy>(0), "compact() needs a cache with invalidate() or clear()");
 
-    if (!distances.empty()) {
-      auto lowerBound = d < threshold ? distances.begin() : std::lower_bound(distances.begin(), distances.end(), d - threshold);
-      auto upperBound = std::upper_bound(distances.begin(), distances.end(), d + threshold);
+    std::lock_guard<std::mutex> lock{_writeMutex};
 
-      for (; lowerBound != upperBound; ++lowerBound) {
-        pendingKeys.push(lookupChildKey(currentKey, *lowerBound));
+    auto tombstones = std::atomic_load(&_view)->tombstones;
+    std::size_t reclaimed = 0;
+
+    for (const auto& key : *tombstones) {
+      std::vector<std::string> ancestors;
+      std::uint32_t distance = 0;
+
+      // reclaimed with an erased ancestor already
+      auto current = std::atomic_load(&_view)->tombstones;
+      if (!current->count(key))
+        continue;
+
+      PendingWrites pending;
+
+      if (!locate(key, ancestors, distance)) {
+        // left by an interrupted compaction
+        pending.erasedIndexes.insert(TOMBSTONE_KEY(key));
+        pending.buried.insert(key);
+        ++reclaimed;
+
+      } else if (std::none_of(ancestors.begin(), ancestors.end(), [&current](const std::string& ancestor) { return current->count(ancestor) > 0; })) {
+        // subtrees under erased ancestors go with them
+        reclaimed += reclaimSubtree(pending, *current, key, ancestors.empty() ? nullptr : &ancestors.back(), distance);
       }
+
+      flush(pending);
     }
+
+    return reclaimed;
   }
 
-  template<typename InputCachePolicy>
-  std::enable_if_t<std::is_base_of<ChildrenKeysCache, InputCachePolicy>::value> appendChildrenKeys(InputCachePolicy& cache, std::uint32_t d, std::uint32_t threshold, const std::string& currentKey, std::queue<std::string>& pendingKeys) {
-    std::pair<std::uint32_t, std::uint32_t> range = std::make_pair(d < threshold ? 0 : d - threshold, d + threshold);
+  template<typename ResultContainer = std::set<std::string>>
+  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit) {
+    return query(key, threshold, limit, threshold);
+  }
 
-    if (!cache.get(currentKey, pendingKeys, range)) {
-      // not hit
-      auto distances = childDistances(currentKey);
+  template<typename ResultContainer = std::set<std::string>>
+  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics) {
+    auto current = std::atomic_load(&_view);
+    Traversal traversal{*current};
 
-      cache.update(currentKey, distances, [this](const std::string& key, std::uint32_t distance) {
-        return this->lookupChildKey(key, distance);
-      }, [this, &distances](const std::string& key, auto& container) {
-        this->lookupChilrenKeys<ChildrenKeyPolicy>(key, distances, container);
-      });
+    return query<ResultContainer>(*current, key, threshold, limit, distanceMetrics, traversal);
+  }
 
-      if (!cache.get(currentKey, pendingKeys, range)) {
-        throw std::logic_error{"no keys loaded after cache updated"};
-      }
-    }
+  // the counters of the query are copied into `stats`, the tree must record them, see StatsPolicy.h
+  template<typename ResultContainer = std::set<std::string>>
+  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics, QueryStats& stats) {
+    static_assert(!std::is_same<StatsPolicy, NoStatsPolicy>::value, "the tree records no stats");
+
+    auto current = std::atomic_load(&_view);
+    Traversal traversal{*current};
+
+    auto values = query<ResultContainer>(*current, key, threshold, limit, distanceMetrics, traversal);
+    stats = traversal.stats.stats();
+
+    return values;
+  }
+
+  //
+  // matches of a radius query one at a time, in the order query() visits them
+  // the traversal advances one batch of nodes whenever the matches found so far are consumed
+  // values are only read when asked for, together with the values of the other buffered matches
+  // the stream reads the view of the tree it was created from and must not outlive the tree
+  //
+  QueryStream queryStream(const std::string& key, std::uint32_t threshold) {
+    return queryStream(key, threshold, threshold);
   }
 
-  template<typename InputChildrenKeyPolicy>
-  std::enable_if_t<std::is_same<InputChildrenKeyPolicy, DisableChildrenKey>::value> putChildrenKey(const std::string& parent, const std::string& child, std::uint32_t pos, leveldb::WriteBatch& batch) {
-    batch.Put(CHILDREN_KEY(child), leveldb::Slice{});
+  QueryStream queryStream(const std::string& key, std::uint32_t threshold, std::uint32_t distanceMetrics) {
+    return QueryStream{ std::make_shared<typename QueryStream::State>(*this, key, threshold, distanceMetrics) };
   }
 
-  template<typename InputChildrenKeyPolicy>
-  std::enable_if_t<!std::is_same<InputChildrenKeyPolicy, DisableChildrenKey>::value> putChildrenKey(const std::string& parent, const std::string& child, std::uint32_t pos, leveldb::WriteBatch& batch) {
-    auto keys = loadIndex(CHILDREN_KEY(parent));
-    InputChildrenKeyPolicy::insert(keys, child, pos);
+  //
+  // radius queries of many keys walking the tree together, one level at a time
+  // each node is read once for all the queries reaching it, which then get their distances to it in one loop
+  // a value matched by several queries is read once as well
+  // results are in the order of keys, with a limit the values kept may differ from the ones of query()
+  //
+  template<typename ResultContainer = std::set<std::string>>
+  std::vector<ResultContainer> queryBatch(const std::vector<std::string>& keys, std::uint32_t threshold) {
+    return queryBatch<ResultContainer>(keys, threshold, std::numeric_limits<std::uint32_t>::max(), threshold);
+  }
 
-    batch.Put(CHILDREN_KEY(child), leveldb::Slice{});
-    batch.Put(CHILDREN_KEY(parent), keys);
+  template<typename ResultContainer = std::set<std::string>>
+  std::vector<ResultContainer> queryBatch(const std::vector<std::string>& keys, std::uint32_t threshold, std::uint32_t limit) {
+    return queryBatch<ResultContainer>(keys, threshold, limit, threshold);
   }
 
-  template<typename InputChildrenKeyPolicy>
-  std::enable_if_t<std::is_same<InputChildrenKeyPolicy, DisableChildrenKey>::value> lookupChilrenKeys(const std::string& key, const std::vector<std::uint32_t>& distances, std::vector<std::string>& keys) {
-    keys.reserve(distances.size());
+  template<typename ResultContainer = std::set<std::string>>
+  std::vector<ResultContainer> queryBatch(const std::vector<std::string>& keys, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics) {
+    std::vector<ResultContainer> results(keys.size());
+
+    auto current = std::atomic_load(&_view);
+    const auto& view = *current;
+    if (view.rootKey.empty() || keys.empty())
+      return results;
+
+    std::vector<QueryDistance<DistancePolicy>> queryDistances;
+    queryDistances.reserve(keys.size());
+    for (const auto& key : keys) {
+      queryDistances.emplace_back(key);
+    }
+
+    // queries reaching each node of the current level, ordered by node key
+    std::map<std::string, std::vector<std::uint32_t>> level;
+    auto& rootQueries = level[view.rootKey];
+    for (std::uint32_t q = 0; q != keys.size(); ++q) {
+      rootQueries.push_back(q);
+    }
 
-    for (auto i : distances) {
-      keys.push_back(lookupChildKey(key, i));
+    std::vector<std::string> nodeKeys;
+    std::vector<std::vector<std::uint32_t>> nodeQueries;
+    std::vector<const PinnedNodes::Node *> nodes;
+    std::vector<NodeChildren> children;
+    std::vector<std::uint32_t> bounds;
+    BatchReads reads;
+    // queries of a batch share their reads, they are not recorded
+    Recorder unrecorded;
+
+    // query and node of each match
+    std::vector<std::pair<std::uint32_t, std::size_t>> matches;
+    std::queue<std::string> childrenKeys;
+
+    while (!level.empty()) {
+      std::map<std::string, std::vector<std::uint32_t>> nextLevel;
+
+      for (auto it = level.begin(); it != level.end(); ) {
+        nodeKeys.clear();
+        nodeQueries.clear();
+        for (; it != level.end() && nodeKeys.size() != SharedNodesBatchSize; ++it) {
+          nodeKeys.push_back(it->first);
+          nodeQueries.push_back(std::move(it->second));
+        }
+
+        nodes.resize(nodeKeys.size());
+        children.resize(nodeKeys.size());
+        bounds.resize(nodeKeys.size());
+
+        for (std::size_t i = 0; i != nodeKeys.size(); ++i) {
+          nodes[i] = view.pinnedNodes->find(nodeKeys[i]);
+        }
+
+        nodeBounds(_cachePolicy, view, nodeKeys, nodes, threshold, distanceMetrics, children, bounds, reads, unrecorded);
+
+        matches.clear();
+        for (std::size_t i = 0; i != nodeKeys.size(); ++i) {
+          const bool erased = view.tombstones->count(nodeKeys[i]) > 0;
+
+          for (auto q : nodeQueries[i]) {
+            // limited queries stop descending once full
+            if (results[q].size() >= limit)
+              continue;
+
+            auto d = queryDistances[q](nodeKeys[i], bounds[i]);
+            if (d < distanceMetrics && !erased)
+              matches.emplace_back(q, i);
+
+            visitChildren(view, nodes[i], d, threshold, nodeKeys[i], children[i], childrenKeys, unrecorded);
+            for (; !childrenKeys.empty(); childrenKeys.pop()) {
+              nextLevel[std::move(childrenKeys.front())].push_back(q);
+            }
+          }
+        }
+
+        loadMatchedValues(view, nodeKeys, matches, limit, reads, results);
+      }
+
+      level.swap(nextLevel);
     }
+
+    return results;
   }
 
-  template<typename InputChildrenKeyPolicy, typename Container>
-  std::enable_if_t<!std::is_same<InputChildrenKeyPolicy, DisableChildrenKey>::value> lookupChilrenKeys(const std::string& key, const std::vector<std::uint32_t>& distances, Container& keys) {
-    
-    auto queriedKey = loadIndex(CHILDREN_KEY(key));
-    InputChildrenKeyPolicy::split(queriedKey, keys);
+  // key, distance to the query key and value
+  using Neighbour = std::tuple<std::string, std::uint32_t, std::string>;
+
+  //
+  // the k keys closest to `key` within maxDistance, ascending by distance then key
+  // best-first by the lower bound of each node distance, the radius shrinks to the k-th distance found so far
+  // node records are read from the pinned levels or the storage, children keys caches only serve radius queries
+  //
+  std::vector<Neighbour> nearest(const std::string& key, std::size_t k, std::uint32_t maxDistance = std::numeric_limits<std::uint32_t>::max()) {
+    std::vector<Neighbour> neighbours;
+
+    auto current = std::atomic_load(&_view);
+    const auto& view = *current;
+    if (0 == k || view.rootKey.empty())
+      return neighbours;
+
+    QueryDistance<DistancePolicy> queryDistance{key};
+    auto radius = maxDistance;
+
+    // nodes to visit by the lower bound of their distances, the closest on top
+    using Candidate = std::pair<std::uint32_t, std::string>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+    // distances and keys found, the farthest on top
+    std::priority_queue<std::pair<std::uint32_t, std::string>> found;
+
+    candidates.emplace(0, view.rootKey);
+    NodeChildren children;
+
+    while (!candidates.empty() && candidates.top().first <= radius) {
+      auto currentKey = candidates.top().second;
+      candidates.pop();
+
+      auto node = view.pinnedNodes->find(currentKey);
+      if (!node)
+        loadChildren(view.indexes(), currentKey, children);
+
+      auto first = node ? view.pinnedNodes->distancesBegin(*node) : children.distances().data();
+      auto last = node ? view.pinnedNodes->distancesEnd(*node) : children.distances().data() + children.size();
+
+      auto bound = radius == std::numeric_limits<std::uint32_t>::max() ? radius : Helper::pruningBound(first, last, radius, radius + 1);
+      auto d = queryDistance(currentKey, bound);
+
+      if (d <= radius && !view.tombstones->count(currentKey)) {
+        found.emplace(d, currentKey);
+        if (found.size() > k)
+          found.pop();
+
+        if (found.size() == k)
+          radius = std::min(radius, found.top().first);
+      }
+
+      // a child at distance e from the node is at least |d - e| away from key
+      auto range = Helper::childrenRange(first, last, d, radius);
+      for (auto it = range.first; it != range.second; ++it) {
+        auto lowerBound = d > *it ? d - *it : *it - d;
+        auto i = static_cast<std::size_t>(it - first);
+
+        candidates.emplace(lowerBound, node ? view.pinnedNodes->childKey(*node, i) : children.key(i));
+      }
+    }
+
+    neighbours.resize(found.size());
+    for (auto it = neighbours.rbegin(); it != neighbours.rend(); ++it, found.pop()) {
+      *it = Neighbour{ found.top().second, found.top().first, loadValue(view.values(), found.top().second) };
+    }
+
+    return neighbours;
+  }
+
+  //
+  // visit nodes as tasks of the executor, each task expands one node and submits its selected children
+  // returns after every submitted task finished, tasks started after the limit is reached do nothing
+  // must not be called from a task running on the same executor
+  //
+  template<typename ResultContainer = std::set<std::string>, typename Executor>
+  ResultContainer queryParallel(const std::string& key, std::uint32_t threshold, std::uint32_t limit, Executor& executor) {
+    return queryParallel<ResultContainer>(key, threshold, limit, threshold, executor);
+  }
+
+  template<typename ResultContainer = std::set<std::string>, typename Executor>
+  ResultContainer queryParallel(const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics, Executor& executor) {
+    auto query = std::make_shared<ParallelQuery<ResultContainer>>(*this, key, threshold, limit, distanceMetrics);
+
+    query->pending = 1;
+    executor.submit([this, query, &executor]() {
+      this->visitParallel(query, query->view->rootKey, executor);
+    });
+
+    std::unique_lock<std::mutex> lock{query->mutex};
+    query->done.wait(lock, [&query]() { return 0 == query->pending; });
+
+    if (query->error)
+      std::rethrow_exception(query->error);
+
+    return std::move(query->values);
+  }
+
+  //
+  // radius query whose node reads run on the executor ahead of the traversal
+  // while the distances of one batch of pending keys are computed, up to `depth` next batches are being read
+  // records are read from the indexes storage directly, the children keys cache is neither read nor filled
+  // matches the values of query(), must not be called from a task running on the same executor
+  //
+  template<typename ResultContainer = std::set<std::string>, typename Executor>
+  ResultContainer queryPrefetched(const std::string& key, std::uint32_t threshold, std::uint32_t limit, Executor& executor, std::size_t depth = 2) {
+    return queryPrefetched<ResultContainer>(key, threshold, limit, threshold, executor, depth);
+  }
+
+  template<typename ResultContainer = std::set<std::string>, typename Executor>
+  ResultContainer queryPrefetched(const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics, Executor& executor, std::size_t depth = 2) {
+    ResultContainer values;
+
+    auto view = std::atomic_load(&_view);
+    QueryDistance<DistancePolicy> queryDistance{key};
+
+    Traversal traversal{*view};
+    auto& pendingKeys = traversal.pendingKeys;
+
+    Prefetcher<Executor> prefetcher{*this, view, executor, depth};
+    prefetcher.fill(pendingKeys, true);
+
+    while (!prefetcher.empty()) {
+      auto batch = prefetcher.next();
+      const auto& keys = batch->keys;
+      auto& stats = traversal.stats;
+      stats.mergeReads(batch->stats);
+
+      traversal.bounds.resize(keys.size());
+      for (std::size_t i = 0; i != keys.size(); ++i) {
+        traversal.bounds[i] = recordBound(*view, batch->nodes[i], batch->children[i], threshold, distanceMetrics);
+      }
+
+      auto started = stats.start();
+      queryDistance(keys, traversal.bounds, traversal.keyDistances);
+      stats.distances(keys.size(), started);
+
+      for (std::size_t i = 0; i != keys.size(); ++i) {
+        auto d = traversal.keyDistances[i];
+
+        if (d < distanceMetrics && !view->tombstones->count(keys[i])) {
+          started = stats.start();
+          values.emplace(loadValue(view->values(), keys[i]));
+          stats.valueGets(1, started);
+
+          if (values.size() >= limit) {
+            _statsPolicy.add(stats);
+            return values;
+          }
+        }
+
+        auto pending = pendingKeys.size();
+        if (batch->nodes[i]) {
+          view->pinnedNodes->selectChildren(*batch->nodes[i], d, threshold, pendingKeys);
+          stats.visited(view->pinnedNodes->distancesEnd(*batch->nodes[i]) - view->pinnedNodes->distancesBegin(*batch->nodes[i]), pendingKeys.size() - pending);
+        } else {
+          selectChildrenKeys(d, threshold, batch->children[i], pendingKeys);
+          stats.visited(batch->children[i].size(), pendingKeys.size() - pending);
+        }
+
+        // full batches start reading as soon as they are selected
+        prefetcher.fill(pendingKeys, false);
+      }
+
+      prefetcher.fill(pendingKeys, true);
+    }
+
+    _statsPolicy.add(traversal.stats);
+    return values;
+  }
+
+  // counters or settings of the cache
+  CachePolicy& cache() {
+    return _cachePolicy;
+  }
+
+  // counters of every recorded query, see StatsPolicy.h
+  StatsPolicy& stats() {
+    return _statsPolicy;
+  }
+
+  //
+  // visit(key, distance to its parent, value, child count) for every node of the current view, such as MappedBKTreeWriter::write
+  //  in breadth-first order from the root, the children of each node in ascending distance
+  //  nodes are read level by level, the value of erased keys is null since their nodes only route queries
+  //
+  template<typename Callable>
+  void scanNodes(Callable&& visit) {
+    auto current = std::atomic_load(&_view);
+    const auto& view = *current;
+
+    // keys and their distances to their parents
+    std::vector<std::pair<std::string, std::uint32_t>> level;
+    std::vector<std::pair<std::string, std::uint32_t>> nextLevel;
+    BatchReads reads;
+    BatchReads valueReads;
+    std::vector<NodeChildren> children(SharedNodesBatchSize);
+
+    if (!view.rootKey.empty())
+      level.emplace_back(view.rootKey, 0);
+
+    while (!level.empty()) {
+      for (std::size_t first = 0; first < level.size(); first += SharedNodesBatchSize) {
+        auto count = std::min(level.size() - first, SharedNodesBatchSize);
+
+        reads.resizeKeys(count);
+        valueReads.slots.clear();
+        valueReads.keys.clear();
+        for (std::size_t j = 0; j != count; ++j) {
+          const auto& key = level[first + j].first;
+          Helper::nodeKey(key, reads.keys[j]);
+
+          if (!view.tombstones->count(key)) {
+            valueReads.slots.push_back(j);
+            valueReads.keys.push_back(valueKey(key));
+          }
+        }
+
+        _indexesStorage->multiGet(view.indexes(), reads.keys, reads.records, reads.found);
+        _valuesStorage->multiGet(view.values(), valueReads.keys, valueReads.records, valueReads.found);
+
+        for (std::size_t j = 0, v = 0; j != count; ++j) {
+          const auto& key = level[first + j].first;
+          if (!reads.found[j])
+            throw std::runtime_error{"no node of key " + key};
+
+          const std::string *value = nullptr;
+          if (v != valueReads.slots.size() && valueReads.slots[v] == j) {
+            if (!valueReads.found[v])
+              throw std::runtime_error{"no value of key " + key};
+
+            value = &valueReads.records[v++];
+          }
+
+          auto& node = children[j];
+          node.record().swap(reads.records[j]);
+          node.decode();
+
+          visit(key, level[first + j].second, value, node.size());
+          for (std::size_t i = 0; i != node.size(); ++i) {
+            nextLevel.emplace_back(node.key(i), node.distances()[i]);
+          }
+        }
+      }
+
+      level.swap(nextLevel);
+      nextLevel.clear();
+    }
+  }
+
+  //
+  // depth and fanout of the nodes reachable from the root, read level by level from the current view on a thread of its own
+  // the tree must outlive the future
+  //
+  std::future<TreeShape> scanShape() {
+    auto view = std::atomic_load(&_view);
+    return std::async(std::launch::async, [this, view]() {
+      return this->shape(*view);
+    });
+  }
+
+  //
+  // one tree can be shared by concurrent readers and writers, clones are independent trees over the same storages
+  // a clone may start with a copy of the cache, it fills and invalidates its copy on its own afterwards
+  //
+  SelfType* clone(bool copyCache = false) {
+    // views are published and the cache filled under the same lock, so the copied entries belong to the cloned view
+    std::unique_lock<std::mutex> lock{_cacheMutex};
+
+    auto view = std::atomic_load(&_view);
+    std::unique_ptr<SelfType> bktree{ new SelfType(_valuesStorage, _indexesStorage, view->rootKey, *view->tombstones, _pinOptions) };
+
+    if (copyCache) {
+      bktree->_cachePolicy = _cachePolicy;
+    }
+
+    return bktree.release();
+  }
+
+private:
+  std::string rootKey() const {
+    return std::atomic_load(&_view)->rootKey;
+  }
+
+  bool isLatest(const ReadView& view) const {
+    return std::atomic_load(&_view).get() == &view;
+  }
+
+  // locks cache reads for the scope unless the cache is absent or concurrent itself
+  std::unique_lock<std::mutex> lockCacheReads() {
+    if (std::is_same<CachePolicy, NoCachePolicy>::value || std::is_base_of<ConcurrentChildrenKeysCache, CachePolicy>::value)
+      return std::unique_lock<std::mutex>{};
+
+    return std::unique_lock<std::mutex>{_cacheMutex};
+  }
+
+  template<typename InputCachePolicy>
+  static auto invalidateCached(InputCachePolicy& cache, const std::set<std::string>& parents, bool, int) -> decltype(cache.invalidate(std::declval<const std::string&>()), void()) {
+    for (const auto& key : parents) {
+      cache.invalidate(key);
+    }
+  }
+
+  // caches without invalidate() keep the children they loaded until nodes are removed or moved
+  template<typename InputCachePolicy>
+  static auto invalidateCached(InputCachePolicy& cache, const std::set<std::string>&, bool reshaped, long) -> decltype(cache.clear(), void()) {
+    if (reshaped)
+      cache.clear();
+  }
+
+  template<typename InputCachePolicy>
+  static void invalidateCached(InputCachePolicy&, const std::set<std::string>&, bool, ...) {}
+
+  // whether the cache can follow compact(), see invalidateCached
+  template<typename InputCachePolicy>
+  static constexpr auto canDropCached(int) -> decltype(std::declval<InputCachePolicy&>().invalidate(std::declval<const std::string&>()), bool()) {
+    return true;
+  }
+
+  template<typename InputCachePolicy>
+  static constexpr auto canDropCached(long) -> decltype(std::declval<InputCachePolicy&>().clear(), bool()) {
+    return true;
+  }
+
+  template<typename InputCachePolicy>
+  static constexpr bool canDropCached(...) {
+    return std::is_same<InputCachePolicy, NoCachePolicy>::value;
+  }
+
+  //
+  // replace the view after a write, the cache drops the children of `parents` at the same time
+  // the cache only ever holds children of the latest view
+  //
+  void publish(const std::string& rootKey, const std::shared_ptr<const PinnedNodes>& pinnedNodes, const std::shared_ptr<const std::set<std::string>>& tombstones, const std::set<std::string>& parents, bool reshaped = false) {
+    auto view = std::make_shared<const ReadView>(*this, rootKey, pinnedNodes, tombstones);
+
+    std::lock_guard<std::mutex> lock{_cacheMutex};
+    std::atomic_store(&_view, view);
+
+    invalidateCached(_cachePolicy, parents, reshaped, 0);
+  }
+
+  template<typename ResultContainer, typename Executor>
+  void visitParallel(const std::shared_ptr<ParallelQuery<ResultContainer>>& query, const std::string& currentKey, Executor& executor) {
+    try {
+      if (!query->stopped) {
+        NodeChildren children;
+        std::queue<std::string> childrenKeys;
+        // nodes visited by tasks are not recorded
+        Recorder unrecorded;
+
+        auto node = query->view->pinnedNodes->find(currentKey);
+        auto bound = visitBound(*query->view, node, currentKey, query->threshold, query->distanceMetrics, children);
+        auto d = query->queryDistance(currentKey, bound);
+
+        if (d < query->distanceMetrics && !query->view->tombstones->count(currentKey)) {
+          auto value = loadValue(query->view->values(), currentKey);
+
+          std::lock_guard<std::mutex> lock{query->mutex};
+          if (!query->stopped) {
+            query->values.emplace(std::move(value));
+            if (query->values.size() >= query->limit)
+              query->stopped = true;
+          }
+        }
+
+        if (!query->stopped) {
+          visitChildren(*query->view, node, d, query->threshold, currentKey, children, childrenKeys, unrecorded);
+
+          for (; !childrenKeys.empty(); childrenKeys.pop()) {
+            {
+              std::lock_guard<std::mutex> lock{query->mutex};
+              ++query->pending;
+            }
+
+            try {
+              executor.submit([this, query, childKey = std::move(childrenKeys.front()), &executor]() {
+                this->visitParallel(query, childKey, executor);
+              });
+            } catch (...) {
+              std::lock_guard<std::mutex> lock{query->mutex};
+              --query->pending;
+              throw;
+            }
+          }
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock{query->mutex};
+      if (!query->error)
+        query->error = std::current_exception();
+
+      query->stopped = true;
+    }
+
+    std::lock_guard<std::mutex> lock{query->mutex};
+    if (0 == --query->pending)
+      query->done.notify_all();
+  }
+
+  template<class OverwritePolicy>
+  void storeRootKey(const std::string& key, const std::string& value) {
+    typename Storage::WriteBatch valuesBatch;
+    typename Storage::WriteBatch indexesBatch;
+    auto& batch = _singleStorage ? valuesBatch : indexesBatch;
+
+    valuesBatch.put(valueKey(key), value);
+    if (!_singleStorage)
+      _valuesStorage->write(valuesBatch);
+
+    // overwrite the root key if has children indexes
+    auto record = loadNode(Snapshot{}, key, true); // return empty record if no such node
+
+    // update root index key
+    batch.put(ROOT_INDEX_KEY, key);
+
+    if (!record.distances.empty()) {
+      OverwritePolicy::overwrite(_indexesStorage, key, record.distances, batch);
+    } else {
+      // create new indexes for the root key  
+      batch.put(NODE_KEY(key), NodeRecord{}.encode());
+    }
+
+    _indexesStorage->write(batch);
+
+    publish(key, pinNodes(key, nullptr, std::set<std::string>{}), std::atomic_load(&_view)->tombstones, std::set<std::string>{ key });
+  }
+
+  void insertPending(PendingWrites& pending, const std::string& key, const std::string& value) {
+    // inserting an erased key again revives it
+    if (placeKey(pending, key) && std::atomic_load(&_view)->tombstones->count(key)) {
+      pending.erasedIndexes.insert(TOMBSTONE_KEY(key));
+      pending.buried.insert(key);
+    }
+
+    pending.values[key] = value;
+  }
+
+  // place the index of `key`, returns true if it is placed already
+  bool placeKey(PendingWrites& pending, const std::string& key) {
+    auto view = std::atomic_load(&_view);
+    std::string currentKey = pending.rootChanged ? pending.root : view->rootKey;
+    std::string childKey;
+
+    while (true) {
+      // get distance 
+      auto d = DistancePolicy::distance(currentKey, key);
+
+      if (0 == d) {
+        return true;
+      }
+
+      if (!findChildKey(pending, *view->pinnedNodes, currentKey, d, childKey)) {
+        // not found
+        storeChild(pending, currentKey, d, key);
+        return false;
+      } 
+      // continue to search storage point
+      currentKey.swap(childKey);
+    }
+  }
+
+  // walk from the root to `key`, collecting the nodes passed and the distance to the last one
+  bool locate(const std::string& key, std::vector<std::string>& ancestors, std::uint32_t& distance) {
+    auto view = std::atomic_load(&_view);
+    std::string currentKey = view->rootKey;
+    std::string childKey;
+
+    if (currentKey.empty())
+      return false;
+
+    while (true) {
+      auto d = DistancePolicy::distance(currentKey, key);
+
+      if (0 == d) {
+        return true;
+      }
+
+      if (!findChildKey(PendingWrites{}, *view->pinnedNodes, currentKey, d, childKey)) {
+        return false;
+      }
+
+      ancestors.push_back(currentKey);
+      distance = d;
+      currentKey.swap(childKey);
+    }
+  }
+
+  //
+  // drop the subtree rooted at `key` from the indexes and place its live keys again, their values are kept
+  // returns the number of erased keys in the subtree
+  //
+  std::size_t reclaimSubtree(PendingWrites& pending, const std::set<std::string>& tombstones, const std::string& key, const std::string *parent, std::uint32_t distance) {
+    std::vector<std::string> liveKeys;
+    std::size_t reclaimed = 0;
+
+    std::queue<std::string> nodes;
+    nodes.push(key);
+    pending.reshaped = true;
+
+    for (; !nodes.empty(); nodes.pop()) {
+      const auto& node = nodes.front();
+
+      for (auto& childKey : loadNode(Snapshot{}, node, true).keys) {
+        nodes.push(std::move(childKey));
+      }
+
+      pending.erasedNodes.insert(node);
+      pending.parents.insert(node);
+
+      if (tombstones.count(node)) {
+        pending.erasedValues.insert(node);
+        pending.erasedIndexes.insert(TOMBSTONE_KEY(node));
+        pending.buried.insert(node);
+        ++reclaimed;
+      } else {
+        liveKeys.push_back(node);
+      }
+    }
+
+    auto placed = liveKeys.begin();
+
+    if (parent) {
+      // detach from the parent
+      pendingNode(pending, *parent).erase(distance);
+      pending.parents.insert(*parent);
+
+    } else {
+      // the root is erased, the first live key takes its place
+      pending.rootChanged = true;
+
+      if (placed != liveKeys.end()) {
+        pending.root = *placed++;
+
+        pending.indexes[std::string{}] = pending.root;
+        pending.nodes[pending.root] = NodeRecord{};
+      } else {
+        pending.erasedIndexes.insert(std::string{});
+      }
+    }
+
+    for (; placed != liveKeys.end(); ++placed) {
+      placeKey(pending, *placed);
+    }
+
+    return reclaimed;
+  }
+
+  void flush(PendingWrites& pending) {
+    if (pending.values.empty() && pending.indexes.empty() && pending.nodes.empty() && pending.erasedIndexes.empty() && pending.erasedNodes.empty())
+      return;
+
+    // values go first and are deleted last, so that no index ever refers to a missing value
+    // a single storage gets all of them in one batch instead
+    typename Storage::WriteBatch valuesBatch;
+    typename Storage::WriteBatch splitIndexesBatch;
+    typename Storage::WriteBatch splitErasedValuesBatch;
+
+    auto& indexesBatch = _singleStorage ? valuesBatch : splitIndexesBatch;
+    auto& erasedValuesBatch = _singleStorage ? valuesBatch : splitErasedValuesBatch;
+
+    for (const auto& keyValue : pending.values) {
+      valuesBatch.put(valueKey(keyValue.first), keyValue.second);
+    }
+
+    for (const auto& key : pending.erasedIndexes) {
+      if (!pending.indexes.count(key))
+        indexesBatch.remove(key);
+    }
+
+    for (const auto& key : pending.erasedNodes) {
+      if (!pending.nodes.count(key))
+        indexesBatch.remove(NODE_KEY(key));
+    }
+
+    for (const auto& keyValue : pending.indexes) {
+      indexesBatch.put(keyValue.first, keyValue.second);
+    }
+
+    for (const auto& keyRecord : pending.nodes) {
+      indexesBatch.put(NODE_KEY(keyRecord.first), keyRecord.second.encode());
+    }
+
+    for (const auto& key : pending.erasedValues) {
+      if (!pending.values.count(key))
+        erasedValuesBatch.remove(valueKey(key));
+    }
+
+    if (_singleStorage) {
+      _valuesStorage->write(valuesBatch);
+
+    } else {
+      if (!pending.values.empty())
+        _valuesStorage->write(valuesBatch);
+
+      if (!pending.indexes.empty() || !pending.nodes.empty() || !pending.erasedIndexes.empty() || !pending.erasedNodes.empty())
+        _indexesStorage->write(indexesBatch);
+
+      if (!pending.erasedValues.empty())
+        _valuesStorage->write(erasedValuesBatch);
+    }
+
+    auto view = std::atomic_load(&_view);
+    auto tombstones = view->tombstones;
+
+    if (!pending.buried.empty()) {
+      auto remaining = std::make_shared<std::set<std::string>>(*tombstones);
+      for (const auto& key : pending.buried) {
+        remaining->erase(key);
+      }
+
+      tombstones = std::move(remaining);
+    }
+
+    if (pending.rootChanged) {
+      publish(pending.root, pinNodes(pending.root, nullptr, std::set<std::string>{}), tombstones, pending.parents, pending.reshaped);
+    } else {
+      publish(view->rootKey, refreshPinnedNodes(view->rootKey, view->pinnedNodes, pending.parents), tombstones, pending.parents, pending.reshaped);
+    }
+  }
+
+  //
+  // load the pinned levels below `root` breadth first, nodes of `previous` not listed in `changed` are copied without storage reads
+  //
+  std::shared_ptr<const PinnedNodes> pinNodes(const std::string& root, const PinnedNodes *previous, const std::set<std::string>& changed) {
+    auto pinnedNodes = std::make_shared<PinnedNodes>();
+    if (root.empty() || 0 == _pinOptions.levels || 0 == _pinOptions.maxNodes)
+      return pinnedNodes;
+
+    // key ids and levels of nodes to pin
+    std::queue<std::pair<std::uint32_t, std::uint32_t>> pendingNodes;
+    pendingNodes.emplace(pinnedNodes->addKey(root), 0);
+    std::size_t scheduled = 1;
+
+    std::vector<std::uint32_t> distances;
+    std::vector<std::string> keys;
+    std::vector<std::uint32_t> keyIds;
+
+    for (; !pendingNodes.empty(); pendingNodes.pop()) {
+      auto keyId = pendingNodes.front().first;
+      auto level = pendingNodes.front().second;
+      auto key = pinnedNodes->key(keyId);
+
+      auto node = (previous && !changed.count(key)) ? previous->find(key) : nullptr;
+      if (node) {
+        previous->children(*node, distances, keys);
+      } else {
+        auto record = loadNode(Snapshot{}, key, true);
+        distances.swap(record.distances);
+        keys.swap(record.keys);
+      }
+
+      keyIds.clear();
+      for (const auto& childKey : keys) {
+        keyIds.push_back(pinnedNodes->addKey(childKey));
+      }
+
+      pinnedNodes->addNode(keyId, distances, keyIds);
+
+      if (level + 1 < _pinOptions.levels) {
+        for (auto childKeyId : keyIds) {
+          if (scheduled == _pinOptions.maxNodes)
+            break;
+
+          pendingNodes.emplace(childKeyId, level + 1);
+          ++scheduled;
+        }
+      }
+    }
+
+    pinnedNodes->seal();
+    return pinnedNodes;
+  }
+
+  std::shared_ptr<const PinnedNodes> refreshPinnedNodes(const std::string& root, const std::shared_ptr<const PinnedNodes>& pinnedNodes, const std::set<std::string>& parents) {
+    bool changed = std::any_of(parents.begin(), parents.end(), [&pinnedNodes](const std::string& parent) {
+      return nullptr != pinnedNodes->find(parent);
+    });
+
+    return changed ? pinNodes(root, pinnedNodes.get(), parents) : pinnedNodes;
+  }
+
+  // nodes touched in this round first, then pinned nodes, which match the storage otherwise
+  bool findChildKey(const PendingWrites& pending, const PinnedNodes& pinnedNodes, const std::string& key, std::uint32_t distance, std::string& childKey) {
+    auto found = pending.nodes.find(key);
+    if (found != pending.nodes.end())
+      return found->second.find(distance, childKey);
+
+    if (pending.erasedNodes.count(key))
+      return false;
+
+    auto node = pinnedNodes.find(key);
+    if (node)
+      return pinnedNodes.findChild(*node, distance, childKey);
+
+    return loadNode(Snapshot{}, key).find(distance, childKey);
+  }
+
+  // pending node record, loaded from storage when not touched in this round yet
+  NodeRecord& pendingNode(PendingWrites& pending, const std::string& key) {
+    auto found = pending.nodes.find(key);
+    if (found != pending.nodes.end())
+      return found->second;
+
+    if (pending.erasedNodes.count(key))
+      return pending.nodes[key];
+
+    return pending.nodes.emplace(key, loadNode(Snapshot{}, key)).first->second;
+  }
+
+  void storeChild(PendingWrites& pending, const std::string& parent, std::uint32_t distance, const std::string& key) {
+    // children are kept sorted by distance
+    pendingNode(pending, parent).insert(distance, key);
+    pending.parents.insert(parent);
+
+    pending.nodes[key] = NodeRecord{};
+  }
+
+  static void checkKey(const std::string& key) {
+    if (0 != KeyTraits::Size && key.size() != KeyTraits::Size)
+      throw std::invalid_argument{"key of " + std::to_string(key.size()) + " bytes in a tree of " + std::to_string(KeyTraits::Size) + " bytes keys"};
+  }
+
+  std::string valueKey(const std::string& key) const {
+    return _singleStorage ? VALUE_KEY(key) : key;
+  }
+
+  std::string loadValue(const Snapshot& snapshot, const std::string& key) {
+    std::string queryValue;
+    if (_valuesStorage->get(snapshot, valueKey(key), queryValue)) {
+      return queryValue;
+    }
+
+    throw std::runtime_error{"no value of key " + key};
+  }
+
+  NodeRecord loadNode(const Snapshot& snapshot, const std::string& key, bool notFoundTolerated = false) {
+    std::string queryValue;
+
+    if (_indexesStorage->get(snapshot, NODE_KEY(key), queryValue)) {
+      return NodeRecord::decode(queryValue);
+    }
+
+    if (notFoundTolerated) {
+      // return empty one
+      return NodeRecord{};
+    }
+
+    throw std::runtime_error{"no node of key " + key};
+  }
+
+  // read path, the record is loaded into the reused buffer and decoded in place
+  void loadChildren(const Snapshot& snapshot, const std::string& key, NodeChildren& children) {
+    if (!_indexesStorage->get(snapshot, NODE_KEY(key), children.record()))
+      throw std::runtime_error{"no node of key " + key};
+
+    children.decode();
+  }
+
+  TreeShape shape(const ReadView& view) {
+    TreeShape shape;
+    std::vector<std::string> level;
+    std::vector<std::string> nextLevel;
+    BatchReads reads;
+    NodeChildren children;
+
+    if (!view.rootKey.empty())
+      level.push_back(view.rootKey);
+
+    while (!level.empty()) {
+      shape.nodes += level.size();
+      shape.depths.push_back(level.size());
+
+      for (std::size_t first = 0; first < level.size(); first += SharedNodesBatchSize) {
+        reads.resizeKeys(std::min(level.size() - first, SharedNodesBatchSize));
+        for (std::size_t j = 0; j != reads.keys.size(); ++j) {
+          Helper::nodeKey(level[first + j], reads.keys[j]);
+        }
+
+        _indexesStorage->multiGet(view.indexes(), reads.keys, reads.records, reads.found);
+
+        for (std::size_t j = 0; j != reads.keys.size(); ++j) {
+          if (!reads.found[j])
+            throw std::runtime_error{"no node of key " + level[first + j]};
+
+          children.record().swap(reads.records[j]);
+          children.decode();
+
+          ++shape.fanouts[children.size()];
+          for (std::size_t i = 0; i != children.size(); ++i) {
+            nextLevel.push_back(children.key(i));
+          }
+        }
+      }
+
+      level.swap(nextLevel);
+      nextLevel.clear();
+    }
+
+    return shape;
+  }
+
+  // Helper::pruningBound over the distances of a loaded node
+  static std::uint32_t pruningBound(const std::vector<std::uint32_t>& distances, std::uint32_t threshold, std::uint32_t distanceMetrics) {
+    return Helper::pruningBound(distances.data(), distances.data() + distances.size(), threshold, distanceMetrics);
+  }
+
+  template<typename InputCachePolicy>
+  std::enable_if_t<std::is_same<InputCachePolicy, NoCachePolicy>::value, std::uint32_t> nodeBound(InputCachePolicy& cache, const ReadView& view, const std::string& currentKey, std::uint32_t threshold, std::uint32_t distanceMetrics, NodeChildren& children) {
+    // the node is loaded first so the distance computation can stop at the pruning bound
+    loadChildren(view.indexes(), currentKey, children);
+
+    return pruningBound(children.distances(), threshold, distanceMetrics);
+  }
+
+  template<typename InputCachePolicy>
+  std::enable_if_t<std::is_base_of<ChildrenKeysCache, InputCachePolicy>::value, std::uint32_t> nodeBound(InputCachePolicy& cache, const ReadView& view, const std::string& currentKey, std::uint32_t threshold, std::uint32_t distanceMetrics, NodeChildren& children) {
+    // children distances are unknown until the cache is asked for a range
+    return std::numeric_limits<std::uint32_t>::max();
+  }
+
+  template<typename ResultContainer>
+  ResultContainer query(const ReadView& view, const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics, Traversal& traversal) {
+    ResultContainer values;
+    QueryDistance<DistancePolicy> queryDistance{key};
+
+    while (!traversal.pendingKeys.empty()) {
+      bool more = visitBatch(view, queryDistance, threshold, distanceMetrics, traversal, [&](const std::string& matchedKey, std::uint32_t) {
+        auto started = traversal.stats.start();
+        values.emplace(loadValue(view.values(), matchedKey));
+        traversal.stats.valueGets(1, started);
+
+        return values.size() < limit;
+      });
+
+      if (!more)
+        break;
+    }
+
+    _statsPolicy.add(traversal.stats);
+    return values;
+  }
+
+  //
+  // expand the next batch of pending keys, onMatch(key, distance) is called for every live key within distanceMetrics
+  // returns false as soon as onMatch does, the rest of the batch is left unvisited then
+  //
+  template<typename Callable>
+  bool visitBatch(const ReadView& view, const QueryDistance<DistancePolicy>& queryDistance, std::uint32_t threshold, std::uint32_t distanceMetrics, Traversal& traversal, Callable&& onMatch) {
+    auto& currentKeys = traversal.currentKeys;
+
+    // popped into the strings of the previous batch
+    currentKeys.resize(std::min(traversal.pendingKeys.size(), QueryBatchSize));
+    for (auto& currentKey : currentKeys) {
+      traversal.pendingKeys.pop(currentKey);
+    }
+
+    traversal.currentNodes.resize(currentKeys.size());
+    traversal.children.resize(currentKeys.size());
+    traversal.bounds.resize(currentKeys.size());
+
+    for (std::size_t i = 0; i != currentKeys.size(); ++i) {
+      traversal.currentNodes[i] = view.pinnedNodes->find(currentKeys[i]);
+    }
+
+    nodeBounds(_cachePolicy, view, currentKeys, traversal.currentNodes, threshold, distanceMetrics, traversal.children, traversal.bounds, traversal.reads, traversal.stats);
+
+    auto started = traversal.stats.start();
+    queryDistance(currentKeys, traversal.bounds, traversal.keyDistances);
+    traversal.stats.distances(currentKeys.size(), started);
+
+    for (std::size_t i = 0; i != currentKeys.size(); ++i) {
+      auto d = traversal.keyDistances[i];
+
+      // erased keys are skipped without reading their values
+      if (d < distanceMetrics && !view.tombstones->count(currentKeys[i])) {
+        if (!onMatch(currentKeys[i], d))
+          return false;
+      }
+
+      visitChildren(view, traversal.currentNodes[i], d, threshold, currentKeys[i], traversal.children[i], traversal.pendingKeys, traversal.stats);
+    }
+
+    return true;
+  }
+
+  //
+  // values of the nodes matched by queryBatch, matches are grouped by node and each node value is read once
+  //
+  template<typename ResultContainer>
+  void loadMatchedValues(const ReadView& view, const std::vector<std::string>& nodeKeys, const std::vector<std::pair<std::uint32_t, std::size_t>>& matches, std::uint32_t limit, BatchReads& reads, std::vector<ResultContainer>& results) {
+    reads.keys.clear();
+    for (std::size_t m = 0; m != matches.size(); ++m) {
+      if (0 == m || matches[m].second != matches[m - 1].second)
+        reads.keys.push_back(valueKey(nodeKeys[matches[m].second]));
+    }
+
+    if (reads.keys.empty())
+      return;
+
+    _valuesStorage->multiGet(view.values(), reads.keys, reads.records, reads.found);
+
+    std::size_t slot = 0;
+    for (std::size_t m = 0; m != matches.size(); ++m) {
+      if (0 != m && matches[m].second != matches[m - 1].second)
+        ++slot;
+
+      if (!reads.found[slot])
+        throw std::runtime_error{"no value of key " + nodeKeys[matches[m].second]};
+
+      auto& values = results[matches[m].first];
+      if (values.size() < limit)
+        values.emplace(reads.records[slot]);
+    }
+  }
+
+  //
+  // records of the unpinned nodes of a batch, read with one multiGet
+  // record buffers are swapped between the batch and the children, so both keep their capacity
+  //
+  void readRecords(const ReadView& view, const std::vector<std::string>& keys, const std::vector<const PinnedNodes::Node *>& nodes, std::vector<NodeChildren>& children, BatchReads& reads, Recorder& stats) {
+    reads.slots.clear();
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      if (!nodes[i])
+        reads.slots.push_back(i);
+    }
+
+    if (reads.slots.empty())
+      return;
+
+    // node keys are written into the strings of the previous batch
+    reads.resizeKeys(reads.slots.size());
+    for (std::size_t j = 0; j != reads.slots.size(); ++j) {
+      Helper::nodeKey(keys[reads.slots[j]], reads.keys[j]);
+    }
+
+    auto started = stats.start();
+    _indexesStorage->multiGet(view.indexes(), reads.keys, reads.records, reads.found);
+    stats.indexGets(reads.keys.size(), started);
+
+    for (std::size_t j = 0; j != reads.slots.size(); ++j) {
+      auto i = reads.slots[j];
+      if (!reads.found[j])
+        throw std::runtime_error{"no node of key " + keys[i]};
+
+      children[i].record().swap(reads.records[j]);
+      children[i].decode();
+    }
+  }
+
+  // bound of a node whose record is pinned or already read
+  static std::uint32_t recordBound(const ReadView& view, const PinnedNodes::Node *node, const NodeChildren& children, std::uint32_t threshold, std::uint32_t distanceMetrics) {
+    if (node)
+      return Helper::pruningBound(view.pinnedNodes->distancesBegin(*node), view.pinnedNodes->distancesEnd(*node), threshold, distanceMetrics);
+
+    return pruningBound(children.distances(), threshold, distanceMetrics);
+  }
+
+  // bounds of a batch of nodes, see readRecords
+  template<typename InputCachePolicy>
+  std::enable_if_t<std::is_same<InputCachePolicy, NoCachePolicy>::value> nodeBounds(InputCachePolicy& cache, const ReadView& view, const std::vector<std::string>& keys, const std::vector<const PinnedNodes::Node *>& nodes, std::uint32_t threshold, std::uint32_t distanceMetrics, std::vector<NodeChildren>& children, std::vector<std::uint32_t>& bounds, BatchReads& reads, Recorder& stats) {
+    readRecords(view, keys, nodes, children, reads, stats);
+
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      bounds[i] = recordBound(view, nodes[i], children[i], threshold, distanceMetrics);
+    }
+  }
+
+  template<typename InputCachePolicy>
+  std::enable_if_t<std::is_base_of<ChildrenKeysCache, InputCachePolicy>::value> nodeBounds(InputCachePolicy& cache, const ReadView& view, const std::vector<std::string>& keys, const std::vector<const PinnedNodes::Node *>& nodes, std::uint32_t threshold, std::uint32_t distanceMetrics, std::vector<NodeChildren>& children, std::vector<std::uint32_t>& bounds, BatchReads&, Recorder&) {
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      bounds[i] = visitBound(view, nodes[i], keys[i], threshold, distanceMetrics, children[i]);
+    }
+  }
+
+  // pinned nodes are served from memory, others through the cache policy
+  std::uint32_t visitBound(const ReadView& view, const PinnedNodes::Node *node, const std::string& currentKey, std::uint32_t threshold, std::uint32_t distanceMetrics, NodeChildren& children) {
+    if (node)
+      return Helper::pruningBound(view.pinnedNodes->distancesBegin(*node), view.pinnedNodes->distancesEnd(*node), threshold, distanceMetrics);
+
+    return nodeBound(_cachePolicy, view, currentKey, threshold, distanceMetrics, children);
+  }
+
+  // pending keys are a std::queue<std::string> or a KeyQueue
+  template<typename PendingKeys>
+  void visitChildren(const ReadView& view, const PinnedNodes::Node *node, std::uint32_t d, std::uint32_t threshold, const std::string& currentKey, NodeChildren& children, PendingKeys& pendingKeys, Recorder& stats) {
+    auto pending = pendingKeys.size();
+
+    if (node) {
+      view.pinnedNodes->selectChildren(*node, d, threshold, pendingKeys);
+      stats.visited(view.pinnedNodes->distancesEnd(*node) - view.pinnedNodes->distancesBegin(*node), pendingKeys.size() - pending);
+      return;
+    }
+
+    auto size = appendChildrenKeys(_cachePolicy, view, d, threshold, currentKey, children, pendingKeys, stats);
+    stats.visited(size, pendingKeys.size() - pending);
+  }
+
+  // only the selected keys are copied out of the record
+  template<typename PendingKeys>
+  static void selectChildrenKeys(std::uint32_t d, std::uint32_t threshold, const NodeChildren& children, PendingKeys& pendingKeys) {
+    auto range = children.range(d, threshold);
+
+    for (auto i = range.first; i != range.second; ++i) {
+      pendingKeys.emplace(children.keyData(i), children.keySize(i));
+    }
+  }
+
+  // both return the number of children of the node, Recorder::UnknownChildren if served by the cache
+  template<typename InputCachePolicy, typename PendingKeys>
+  std::enable_if_t<std::is_same<InputCachePolicy, NoCachePolicy>::value, std::size_t> appendChildrenKeys(InputCachePolicy& cache, const ReadView& view, std::uint32_t d, std::uint32_t threshold, const std::string& currentKey, NodeChildren& children, PendingKeys& pendingKeys, Recorder&) {
+    selectChildrenKeys(d, threshold, children, pendingKeys);
+    return children.size();
+  }
+
+  template<typename PendingKeys>
+  static void moveKeys(std::queue<std::string>& keys, PendingKeys& pendingKeys) {
+    for (; !keys.empty(); keys.pop()) {
+      pendingKeys.push(std::move(keys.front()));
+    }
+  }
+
+  template<typename InputCachePolicy, typename PendingKeys>
+  std::enable_if_t<std::is_base_of<ChildrenKeysCache, InputCachePolicy>::value, std::size_t> appendChildrenKeys(InputCachePolicy& cache, const ReadView& view, std::uint32_t d, std::uint32_t threshold, const std::string& currentKey, NodeChildren& children, PendingKeys& pendingKeys, Recorder& stats) {
+    auto upper = d > std::numeric_limits<std::uint32_t>::max() - threshold ? std::numeric_limits<std::uint32_t>::max() : d + threshold;
+    std::pair<std::uint32_t, std::uint32_t> range = std::make_pair(d < threshold ? 0 : d - threshold, upper);
+
+    // the cache holds children of the latest view only, older views read their snapshots
+    // a view published while reading could have refilled the entry, so the view is checked on both sides
+    std::queue<std::string> cachedKeys;
+    bool hit = false;
+    {
+      auto lock = lockCacheReads();
+      hit = isLatest(view) && cache.get(currentKey, cachedKeys, range) && isLatest(view);
+    }
+
+    if (hit) {
+      stats.cacheHit();
+      moveKeys(cachedKeys, pendingKeys);
+      return Recorder::UnknownChildren;
+    }
+
+    // not hit, the node is loaded without holding the cache lock
+    stats.cacheMiss();
+
+    auto started = stats.start();
+    loadChildren(view.indexes(), currentKey, children);
+    stats.indexGets(1, started);
+
+    {
+      std::lock_guard<std::mutex> lock{_cacheMutex};
+
+      // views are published under the same lock
+      if (isLatest(view)) {
+        cache.update(currentKey, children.distances(), [&children](const std::string& key, std::uint32_t distance) {
+          std::string childKey;
+          children.find(distance, childKey);
+          return childKey;
+        }, [&children](const std::string& key, auto& container) {
+          for (std::size_t i = 0; i != children.size(); ++i) {
+            container.emplace_back(children.keyBegin(i), children.keyEnd(i));
+          }
+        });
+
+        if (!cache.get(currentKey, cachedKeys, range)) {
+          throw std::logic_error{"no keys loaded after cache updated"};
+        }
+
+        moveKeys(cachedKeys, pendingKeys);
+        return children.size();
+      }
+    }
+
+    selectChildrenKeys(d, threshold, children, pendingKeys);
+    return children.size();
   }
 };
 
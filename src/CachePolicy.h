@@ -15,7 +15,22 @@ struct NoCachePolicy {};
 // require
 //	bool get(const std::string& key, std::queue<std::string>& keys, const std::pair<std::uint32_t, std::uint32_t>& range)
 //	void update(const std::string& key, const std::vector<std::uint32_t>& distances, LoadSingleCallable loadChildKey, LoadAllCallable loadChildrenKeys)
+//    loadChildrenKeys(key, container) calls container.emplace_back(first, last) with the characters of each child key in distance order
+//
+// optional
+//	void invalidate(const std::string& key)
+//    drops the cached children of key, called after new children were stored under it or its children changed
+//    caches without it keep serving the children they loaded first
+//
+//	void clear()
+//    drops every cached children, called when compact() removes or moves nodes and the cache has no invalidate()
+//    compact() does not compile for caches with neither
 //
 class ChildrenKeysCache {};
 
+//
+// caches safe for concurrent get/update/invalidate calls, the tree only serializes their updates with invalidations
+//
+class ConcurrentChildrenKeysCache : public ChildrenKeysCache {};
+
 #endif // CACHE_POLICY_H
@@ -10,11 +10,10 @@
 #define CHILDREN_KEY_POLICY_H
 
 //
-// You need to implement some helper functions to update/parse queried children value
-//	The queried children value is a string and you need to desgin how keys chained together
-//	inside the string
+// deprecated, node records keep the children keys of every node and this policy is no longer called
+//	kept so trees declared with a policy still compile
 //
-// required
+// it used to be
 //  static void insert(std::string& keys, const std::string& newKey, std::uint32_t pos)
 //	static void split(const std::string& keys, Container& splitKeys)
 //
@@ -0,0 +1,221 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef DISTANCE_POLICY_TRAITS_H
+#define DISTANCE_POLICY_TRAITS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+//
+// DistancePolicy requires
+//	static std::uint32_t distance(const std::string& key, const std::string& queryKey)
+//
+// optional
+//	static Pattern prepare(const std::string& queryKey)
+//	static std::uint32_t distance(const Pattern& pattern, const std::string& key)
+//    precomputes per query state, must be equal to distance(key, queryKey)
+//
+//	static std::uint32_t distance(const std::string& key, const std::string& queryKey, std::uint32_t maxDistance)
+//	static std::uint32_t distance(const Pattern& pattern, const std::string& key, std::uint32_t maxDistance)
+//    may stop early, must return the exact distance if it is not greater than maxDistance or any greater value otherwise
+//
+//	static void distance(const Pattern& pattern, const std::vector<std::string>& keys, const std::vector<std::uint32_t>& maxDistances, std::vector<std::uint32_t>& distances)
+//    bounded distances from several keys at once
+//
+//	class Scratch, default constructible Pattern
+//	static void prepare(const std::string& queryKey, Pattern& pattern)
+//	static std::uint32_t distance(const Pattern& pattern, const std::string& key, std::uint32_t maxDistance, Scratch& scratch)
+//    reuse the storage of a previous pattern and of the working buffers, see ReusedQueryDistance
+//
+
+template<typename...>
+struct VoidType { using type = void; };
+
+template<typename DistancePolicy, typename = void>
+struct HasPreparedDistance : std::false_type {};
+
+template<typename DistancePolicy>
+struct HasPreparedDistance<DistancePolicy, typename VoidType<decltype(DistancePolicy::distance(DistancePolicy::prepare(std::declval<const std::string&>()), 
+                                                                                              std::declval<const std::string&>()))>::type> : std::true_type {};
+
+template<typename DistancePolicy, typename = void>
+struct HasBoundedDistance : std::false_type {};
+
+template<typename DistancePolicy>
+struct HasBoundedDistance<DistancePolicy, typename VoidType<decltype(DistancePolicy::distance(std::declval<const std::string&>(),
+                                                                                             std::declval<const std::string&>(),
+                                                                                             std::declval<std::uint32_t>()))>::type> : std::true_type {};
+
+template<typename DistancePolicy, typename = void>
+struct HasBoundedPreparedDistance : std::false_type {};
+
+template<typename DistancePolicy>
+struct HasBoundedPreparedDistance<DistancePolicy, typename VoidType<decltype(DistancePolicy::distance(DistancePolicy::prepare(std::declval<const std::string&>()), 
+                                                                                                     std::declval<const std::string&>(),
+                                                                                                     std::declval<std::uint32_t>()))>::type> : std::true_type {};
+
+template<typename DistancePolicy, typename = void>
+struct HasBatchDistance : std::false_type {};
+
+template<typename DistancePolicy>
+struct HasBatchDistance<DistancePolicy, typename VoidType<decltype(DistancePolicy::distance(DistancePolicy::prepare(std::declval<const std::string&>()), 
+                                                                                           std::declval<const std::vector<std::string>&>(),
+                                                                                           std::declval<const std::vector<std::uint32_t>&>(),
+                                                                                           std::declval<std::vector<std::uint32_t>&>()))>::type> : std::true_type {};
+
+template<typename DistancePolicy, typename = void>
+struct HasReusablePattern : std::false_type {};
+
+template<typename DistancePolicy>
+struct HasReusablePattern<DistancePolicy, typename VoidType<decltype(DistancePolicy::prepare(std::declval<const std::string&>(),
+                                                                                            std::declval<decltype(DistancePolicy::prepare(std::declval<const std::string&>()))&>())),
+                                                            decltype(DistancePolicy::distance(DistancePolicy::prepare(std::declval<const std::string&>()),
+                                                                                              std::declval<const std::string&>(),
+                                                                                              std::declval<std::uint32_t>(),
+                                                                                              std::declval<typename DistancePolicy::Scratch&>()))>::type> : std::true_type {};
+
+//
+// distance from every visited key to one query key
+//
+template<typename DistancePolicy, bool = HasPreparedDistance<DistancePolicy>::value>
+class QueryDistance {
+private:
+  const std::string& _queryKey;
+
+public:
+  explicit QueryDistance(const std::string& queryKey)
+    : _queryKey(queryKey)
+  {}
+
+  std::uint32_t operator ()(const std::string& key) const {
+    return DistancePolicy::distance(key, _queryKey);
+  }
+
+  std::uint32_t operator ()(const std::string& key, std::uint32_t maxDistance) const {
+    return bounded(HasBoundedDistance<DistancePolicy>{}, key, maxDistance);
+  }
+
+  void operator ()(const std::vector<std::string>& keys, const std::vector<std::uint32_t>& maxDistances, std::vector<std::uint32_t>& distances) const {
+    distances.resize(keys.size());
+
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      distances[i] = (*this)(keys[i], maxDistances[i]);
+    }
+  }
+
+private:
+  std::uint32_t bounded(std::true_type, const std::string& key, std::uint32_t maxDistance) const {
+    return DistancePolicy::distance(key, _queryKey, maxDistance);
+  }
+
+  std::uint32_t bounded(std::false_type, const std::string& key, std::uint32_t) const {
+    return DistancePolicy::distance(key, _queryKey);
+  }
+};
+
+template<typename DistancePolicy>
+class QueryDistance<DistancePolicy, true> {
+private:
+  decltype(DistancePolicy::prepare(std::declval<const std::string&>())) _pattern;
+
+public:
+  explicit QueryDistance(const std::string& queryKey)
+    : _pattern(DistancePolicy::prepare(queryKey))
+  {}
+
+  std::uint32_t operator ()(const std::string& key) const {
+    return DistancePolicy::distance(_pattern, key);
+  }
+
+  std::uint32_t operator ()(const std::string& key, std::uint32_t maxDistance) const {
+    return bounded(HasBoundedPreparedDistance<DistancePolicy>{}, key, maxDistance);
+  }
+
+  void operator ()(const std::vector<std::string>& keys, const std::vector<std::uint32_t>& maxDistances, std::vector<std::uint32_t>& distances) const {
+    batch(HasBatchDistance<DistancePolicy>{}, keys, maxDistances, distances);
+  }
+
+private:
+  void batch(std::true_type, const std::vector<std::string>& keys, const std::vector<std::uint32_t>& maxDistances, std::vector<std::uint32_t>& distances) const {
+    DistancePolicy::distance(_pattern, keys, maxDistances, distances);
+  }
+
+  void batch(std::false_type, const std::vector<std::string>& keys, const std::vector<std::uint32_t>& maxDistances, std::vector<std::uint32_t>& distances) const {
+    distances.resize(keys.size());
+
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      distances[i] = (*this)(keys[i], maxDistances[i]);
+    }
+  }
+
+  std::uint32_t bounded(std::true_type, const std::string& key, std::uint32_t maxDistance) const {
+    return DistancePolicy::distance(_pattern, key, maxDistance);
+  }
+
+  std::uint32_t bounded(std::false_type, const std::string& key, std::uint32_t) const {
+    return DistancePolicy::distance(_pattern, key);
+  }
+};
+
+//
+// bounded distance to one query key at a time, owned by one thread and reset for every query
+//  policies with a reusable pattern keep the pattern and working buffers of the previous queries
+//  other policies prepare their query key again, as QueryDistance does
+//
+template<typename DistancePolicy, bool = HasReusablePattern<DistancePolicy>::value, bool = HasPreparedDistance<DistancePolicy>::value>
+class ReusedQueryDistance {
+private:
+  std::string _queryKey;
+
+public:
+  void reset(const std::string& queryKey) {
+    _queryKey.assign(queryKey);
+  }
+
+  std::uint32_t operator ()(const std::string& key, std::uint32_t maxDistance) const {
+    return QueryDistance<DistancePolicy>{_queryKey}(key, maxDistance);
+  }
+};
+
+template<typename DistancePolicy>
+class ReusedQueryDistance<DistancePolicy, false, true> {
+private:
+  std::unique_ptr<QueryDistance<DistancePolicy>> _queryDistance;
+
+public:
+  void reset(const std::string& queryKey) {
+    _queryDistance.reset(new QueryDistance<DistancePolicy>{queryKey});
+  }
+
+  std::uint32_t operator ()(const std::string& key, std::uint32_t maxDistance) const {
+    return (*_queryDistance)(key, maxDistance);
+  }
+};
+
+template<typename DistancePolicy, bool Prepared>
+class ReusedQueryDistance<DistancePolicy, true, Prepared> {
+private:
+  decltype(DistancePolicy::prepare(std::declval<const std::string&>())) _pattern;
+  mutable typename DistancePolicy::Scratch _scratch;
+
+public:
+  void reset(const std::string& queryKey) {
+    DistancePolicy::prepare(queryKey, _pattern);
+  }
+
+  std::uint32_t operator ()(const std::string& key, std::uint32_t maxDistance) const {
+    return DistancePolicy::distance(_pattern, key, maxDistance, _scratch);
+  }
+};
+
+#endif // DISTANCE_POLICY_TRAITS_H
@@ -0,0 +1,182 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef HAMMINGDISTANCE
+#define HAMMINGDISTANCE
+
+#include <array>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAMMING_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+//
+// Hamming distance of fixed-width binary keys, such as perceptual hashes
+//  a key is the raw Bits / 8 bytes of the hash in a std::string, see key()
+//  the distance is the population count of the XOR of both keys, keys of any other size are rejected
+//
+// the widest of AVX-512 VPOPCNTDQ / AVX2 / POPCNT kernels supported by the running CPU and fitting the width is selected once
+//  AVX2 counts 256 bits at a time with a nibble lookup table (Mula, Kurz, Lemire 2016)
+//
+template<std::size_t Bits>
+class HammingDistancePolicy {
+  static_assert(Bits > 0 && 0 == Bits % 64, "keys are whole 64-bit words");
+
+public:
+  static constexpr const char Prefix = 'H';
+
+  static constexpr std::size_t Bytes = Bits / 8;
+  static constexpr std::size_t Words = Bits / 64;
+
+  using Words64 = std::array<std::uint64_t, Words>;
+
+  //
+  // the query key checked once
+  //
+  class Pattern {
+  private:
+    std::string _key;
+
+  public:
+    explicit Pattern(const std::string& key)
+      : _key{ checked(key) }
+    {}
+
+    const char *data() const { return _key.data(); }
+  };
+
+public:
+  // key of the words of a hash in host byte order
+  static std::string key(const Words64& words) {
+    return std::string(reinterpret_cast<const char *>(words.data()), Bytes);
+  }
+
+  static Pattern prepare(const std::string& key) {
+    return Pattern{key};
+  }
+
+  static std::uint32_t distance(const std::string& s1, const std::string& s2) {
+    return kernel()(checked(s1).data(), checked(s2).data());
+  }
+
+  static std::uint32_t distance(const Pattern& pattern, const std::string& key) {
+    return kernel()(pattern.data(), checked(key).data());
+  }
+
+  static void distance(const Pattern& pattern, const std::vector<std::string>& keys, const std::vector<std::uint32_t>&, std::vector<std::uint32_t>& distances) {
+    distances.resize(keys.size());
+
+    // exact distances satisfy any bound
+    auto count = kernel();
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      distances[i] = count(pattern.data(), checked(keys[i]).data());
+    }
+  }
+
+private:
+  using Kernel = std::uint32_t (*)(const char *, const char *);
+
+  static const std::string& checked(const std::string& key) {
+    if (key.size() != Bytes)
+      throw std::invalid_argument{"hamming keys must have " + std::to_string(Bytes) + " bytes, not " + std::to_string(key.size())};
+
+    return key;
+  }
+
+  static std::uint64_t word(const char *p, std::size_t i) {
+    std::uint64_t w;
+    std::memcpy(&w, p + i * 8, 8);
+    return w;
+  }
+
+  static Kernel kernel() {
+    static const Kernel selected = selectKernel();
+    return selected;
+  }
+
+  static Kernel selectKernel() {
+#ifdef HAMMING_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (0 == Words % 8 && __builtin_cpu_supports("avx512vpopcntdq"))
+      return &countAVX512;
+    if (0 == Words % 4 && __builtin_cpu_supports("avx2"))
+      return &countAVX2;
+    if (__builtin_cpu_supports("popcnt"))
+      return &countPOPCNT;
+#endif
+    return &countScalar;
+  }
+
+public:
+  //
+  // kernels, public so each one the running CPU supports can be checked against countScalar
+  //
+  static std::uint32_t countScalar(const char *a, const char *b) {
+    std::uint32_t count = 0;
+    for (std::size_t i = 0; i != Words; ++i) {
+      count += static_cast<std::uint32_t>(__builtin_popcountll(word(a, i) ^ word(b, i)));
+    }
+
+    return count;
+  }
+
+#ifdef HAMMING_X86_KERNELS
+  __attribute__((target("popcnt")))
+  static std::uint32_t countPOPCNT(const char *a, const char *b) {
+    std::uint32_t count = 0;
+    for (std::size_t i = 0; i != Words; ++i) {
+      count += static_cast<std::uint32_t>(__builtin_popcountll(word(a, i) ^ word(b, i)));
+    }
+
+    return count;
+  }
+
+  __attribute__((target("avx2")))
+  static std::uint32_t countAVX2(const char *a, const char *b) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i sums = _mm256_setzero_si256();
+
+    for (std::size_t i = 0; i + 32 <= Bytes; i += 32) {
+      __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+                                   _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+
+      __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low)),
+                                       _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+      sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+
+    return static_cast<std::uint32_t>(_mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3));
+  }
+
+  __attribute__((target("avx512f,avx512vpopcntdq")))
+  static std::uint32_t countAVX512(const char *a, const char *b) {
+    __m512i sums = _mm512_setzero_si512();
+
+    for (std::size_t i = 0; i + 64 <= Bytes; i += 64) {
+      __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+      sums = _mm512_add_epi64(sums, _mm512_popcnt_epi64(x));
+    }
+
+    alignas(64) std::uint64_t lanes[8];
+    _mm512_store_si512(lanes, sums);
+
+    return static_cast<std::uint32_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+  }
+#endif
+};
+
+#endif // HAMMINGDISTANCE
@@ -9,8 +9,32 @@
 #ifndef HELPER_H
 #define HELPER_H
 
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <algorithm>
+
 // key to search for tree root key
-#define ROOT_INDEX_KEY leveldb::Slice{}
+#define ROOT_INDEX_KEY std::string{}
+// key holding the index format version
+#define FORMAT_VERSION_KEY std::string("\0v", 2)
+// key of the record holding all children of a node, length prefixed so no other key collides with it
+#define NODE_KEY(key) Helper::nodeKey(key)
+// key marking an erased real key, all of them share the prefix
+#define TOMBSTONE_KEY_PREFIX std::string("\0t", 2)
+#define TOMBSTONE_KEY(key) (TOMBSTONE_KEY_PREFIX + key)
+// marks indexes sharing one storage with the values
+#define SINGLE_STORAGE_KEY std::string("\0s", 2)
+// shard of a ShardedBKTree the indexes belong to, "<shard>/<shards>"
+#define SHARD_KEY std::string("\0h", 2)
+// key of a value when values and indexes share one storage
+#define VALUE_KEY(key) (std::string(1, '\x02') + key)
+
+//
+// legacy layout, only read by IndexMigration
+//
 // key to list all the associated distances
 #define CHILDREN_DISTANCES_KEY(parentKey) (parentKey + 'c')
 // key to query for real keys
@@ -19,13 +43,105 @@
 #define CHILDREN_KEY(parentKey) (parentKey + '0')
 
 struct Helper {
+  // native byte order as the legacy layout stored it, memcpy keeps unaligned input well defined
+  static std::uint32_t parse(const char *value) {
+    std::uint32_t parsed;
+    std::memcpy(&parsed, value, sizeof(std::uint32_t));
+    return parsed;
+  }
+
   static std::uint32_t parse(const std::string& value) {
-    return *reinterpret_cast<const std::uint32_t *>(value.c_str());
+    return parse(value.data());
   }
 
   static std::string stringfy(std::uint32_t value) {
     return std::string(reinterpret_cast<const char *>(&value), sizeof(std::uint32_t) / sizeof(char));
   }
+
+  static void appendVarint(std::string& out, std::uint32_t value) {
+    for (; value >= 0x80; value >>= 7) {
+      out.push_back(static_cast<char>(value | 0x80));
+    }
+
+    out.push_back(static_cast<char>(value));
+  }
+
+  // advances `p`, returns false if the input ends inside the varint
+  static bool parseVarint(const char *& p, const char *limit, std::uint32_t& value) {
+    value = 0;
+
+    for (std::uint32_t shift = 0; shift <= 28 && p != limit; shift += 7) {
+      std::uint32_t byte = static_cast<unsigned char>(*p++);
+      value |= (byte & 0x7f) << shift;
+
+      if (0 == (byte & 0x80))
+        return true;
+    }
+
+    return false;
+  }
+
+  //
+  // binary searches over sorted distances whose loops only select with conditional moves
+  // children lists are short, so mispredicted branches cost more than the comparisons
+  //
+  static const std::uint32_t *lowerBound(const std::uint32_t *first, const std::uint32_t *last, std::uint32_t value) {
+    if (first == last)
+      return first;
+
+    for (auto length = static_cast<std::size_t>(last - first); length > 1; ) {
+      auto half = length / 2;
+      first = first[half - 1] < value ? first + half : first;
+      length -= half;
+    }
+
+    return first + (*first < value);
+  }
+
+  static const std::uint32_t *upperBound(const std::uint32_t *first, const std::uint32_t *last, std::uint32_t value) {
+    if (first == last)
+      return first;
+
+    for (auto length = static_cast<std::size_t>(last - first); length > 1; ) {
+      auto half = length / 2;
+      first = first[half - 1] <= value ? first + half : first;
+      length -= half;
+    }
+
+    return first + (*first <= value);
+  }
+
+  // children whose distances lie within [d - threshold, d + threshold]
+  static std::pair<const std::uint32_t *, const std::uint32_t *> childrenRange(const std::uint32_t *first, const std::uint32_t *last, std::uint32_t d, std::uint32_t threshold) {
+    auto upper = d > std::numeric_limits<std::uint32_t>::max() - threshold ? std::numeric_limits<std::uint32_t>::max() : d + threshold;
+
+    return std::make_pair(d < threshold ? first : lowerBound(first, last, d - threshold), upperBound(first, last, upper));
+  }
+
+  // the largest distance still deciding whether a node is a result or which of its children [first, last) are visited
+  static std::uint32_t pruningBound(const std::uint32_t *first, const std::uint32_t *last, std::uint32_t threshold, std::uint32_t distanceMetrics) {
+    std::uint64_t bound = distanceMetrics > 0 ? distanceMetrics - 1 : 0;
+
+    if (first != last) {
+      bound = std::max(bound, std::uint64_t{*(last - 1)} + threshold);
+    }
+
+    return static_cast<std::uint32_t>(std::min<std::uint64_t>(bound, std::numeric_limits<std::uint32_t>::max()));
+  }
+
+  static std::string nodeKey(const std::string& key) {
+    std::string nodeKey;
+    Helper::nodeKey(key, nodeKey);
+
+    return nodeKey;
+  }
+
+  // into `nodeKey`, reusing its capacity
+  static void nodeKey(const std::string& key, std::string& nodeKey) {
+    nodeKey.assign(1, '\x01');
+    appendVarint(nodeKey, static_cast<std::uint32_t>(key.size()));
+    nodeKey.append(key);
+  }
 };
 
-#endif // HELPER_H
\ No newline at end of file
+#endif // HELPER_H
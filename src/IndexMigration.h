@@ -0,0 +1,174 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef INDEX_MIGRATION_H
+#define INDEX_MIGRATION_H
+
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
+#include <queue>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "Helper.h"
+#include "NodeRecord.h"
+
+//
+// rewrites indexes from the legacy layout into node records
+//
+// [children distances key] -> [native uint32 distances ...]
+// [real key] + [distance]  -> [child real key]
+// [children key]           -> [children keys joined by ChildrenKeyPolicy]
+//
+// the first pass writes one record per node, the second deletes the legacy entries and stamps the format version
+// both passes read records written before, so an interrupted migration can be run again
+// legacy entries are deleted only after every node is read, some of them collide with each other
+//
+struct IndexMigration {
+  // returns the number of nodes migrated, 0 if the indexes are in the current format already
+  static std::size_t migrate(const std::string& indexStoragePath, std::size_t batchNodes = 1 << 12) {
+    leveldb::DB* indexesDB = nullptr;
+
+    auto status = leveldb::DB::Open(leveldb::Options(), indexStoragePath, &indexesDB);
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+
+    std::unique_ptr<leveldb::DB> indexesStorage{indexesDB};
+    return migrate(indexesStorage.get(), batchNodes);
+  }
+
+  static std::size_t migrate(leveldb::DB* indexesDB, std::size_t batchNodes = 1 << 12) {
+    if (0 == batchNodes)
+      throw std::invalid_argument{"batch size must be positive"};
+
+    std::string value;
+    auto status = indexesDB->Get(leveldb::ReadOptions(), FORMAT_VERSION_KEY, &value);
+    if (status.ok())
+      return 0;
+
+    if (!status.IsNotFound())
+      throw std::runtime_error{status.ToString()};
+
+    std::string rootKey;
+    status = indexesDB->Get(leveldb::ReadOptions(), ROOT_INDEX_KEY, &rootKey);
+    if (!status.ok() && !status.IsNotFound())
+      throw std::runtime_error{status.ToString()};
+
+    std::size_t migrated = 0;
+
+    if (status.ok()) {
+      // write node records
+      migrated = visit(indexesDB, rootKey, batchNodes, [](const std::string& key, const NodeRecord& record, bool stored, leveldb::WriteBatch& batch) {
+        if (!stored)
+          batch.Put(NODE_KEY(key), record.encode());
+      });
+
+      // drop legacy entries
+      visit(indexesDB, rootKey, batchNodes, [](const std::string& key, const NodeRecord& record, bool, leveldb::WriteBatch& batch) {
+        batch.Delete(CHILDREN_DISTANCES_KEY(key));
+        batch.Delete(CHILDREN_KEY(key));
+
+        for (auto d : record.distances) {
+          batch.Delete(CHILD_INDEX_KEY(key, d));
+        }
+      });
+    }
+
+    status = indexesDB->Put(leveldb::WriteOptions(), FORMAT_VERSION_KEY, std::to_string(NodeRecord::FormatVersion));
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+
+    return migrated;
+  }
+
+private:
+  // breadth first over the tree, each node is read from its record if stored, otherwise from the legacy entries
+  template<typename Callable>
+  static std::size_t visit(leveldb::DB* indexesDB, const std::string& rootKey, std::size_t batchNodes, Callable&& callable) {
+    std::size_t visited = 0;
+    leveldb::WriteBatch batch;
+
+    std::queue<std::string> pendingKeys;
+    pendingKeys.push(rootKey);
+
+    for (; !pendingKeys.empty(); pendingKeys.pop()) {
+      const auto& key = pendingKeys.front();
+
+      NodeRecord record;
+      bool stored = loadRecord(indexesDB, key, record);
+      if (!stored) {
+        record = loadLegacyRecord(indexesDB, key);
+      }
+
+      callable(key, record, stored, batch);
+
+      for (auto& childKey : record.keys) {
+        pendingKeys.push(std::move(childKey));
+      }
+
+      if (0 == ++visited % batchNodes) {
+        write(indexesDB, batch);
+      }
+    }
+
+    write(indexesDB, batch);
+    return visited;
+  }
+
+  static bool loadRecord(leveldb::DB* indexesDB, const std::string& key, NodeRecord& record) {
+    std::string value;
+    auto status = indexesDB->Get(leveldb::ReadOptions(), NODE_KEY(key), &value);
+    if (status.IsNotFound())
+      return false;
+
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+
+    record = NodeRecord::decode(value);
+    return true;
+  }
+
+  static NodeRecord loadLegacyRecord(leveldb::DB* indexesDB, const std::string& key) {
+    NodeRecord record;
+
+    std::string distances;
+    auto status = indexesDB->Get(leveldb::ReadOptions(), CHILDREN_DISTANCES_KEY(key), &distances);
+    if (status.IsNotFound())
+      return record;
+
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+
+    for (std::size_t offset = 0; offset + sizeof(std::uint32_t) <= distances.size(); offset += sizeof(std::uint32_t)) {
+      auto d = Helper::parse(distances.data() + offset);
+
+      std::string childKey;
+      status = indexesDB->Get(leveldb::ReadOptions(), CHILD_INDEX_KEY(key, d), &childKey);
+      if (!status.ok())
+        throw std::runtime_error{status.ToString()};
+
+      record.distances.push_back(d);
+      record.keys.push_back(std::move(childKey));
+    }
+
+    return record;
+  }
+
+  static void write(leveldb::DB* indexesDB, leveldb::WriteBatch& batch) {
+    auto status = indexesDB->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+
+    batch.Clear();
+  }
+};
+
+#endif // INDEX_MIGRATION_H
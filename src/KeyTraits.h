@@ -0,0 +1,112 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef KEY_TRAITS_H
+#define KEY_TRAITS_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+//
+// KeyTraits requires
+//	static constexpr std::size_t Size
+//    byte length of every key of the tree, 0 if keys vary in length
+//
+struct VariableKeyTraits {
+  static constexpr std::size_t Size = 0;
+};
+
+// keys such as hashes or numeric ids, trees reject keys of any other length
+template<std::size_t N>
+struct FixedKeyTraits {
+  static_assert(N > 0, "fixed keys have at least one byte");
+
+  static constexpr std::size_t Size = N;
+};
+
+//
+// FIFO of the pending keys of a traversal, all of them in one flat buffer
+//  fixed-length keys are slots of Size bytes, the lengths of variable ones are kept aside
+//  keys are copied out into strings whose capacity is reused, so no key allocates once the buffers have grown
+//
+template<typename KeyTraits>
+class KeyQueue {
+private:
+  // pending keys are bytes[head, end)
+  std::string _bytes;
+  std::size_t _head = 0;
+
+  // lengths of variable keys are sizes[sizesHead, end)
+  std::vector<std::uint32_t> _sizes;
+  std::size_t _sizesHead = 0;
+
+  // popped bytes kept before moving the rest to the front
+  static constexpr std::size_t CompactBytes = 1 << 16;
+
+public:
+  bool empty() const {
+    // variable keys may be empty strings
+    return 0 != KeyTraits::Size ? _head == _bytes.size() : _sizesHead == _sizes.size();
+  }
+
+  std::size_t size() const {
+    return 0 != KeyTraits::Size ? (_bytes.size() - _head) / KeyTraits::Size : _sizes.size() - _sizesHead;
+  }
+
+  void emplace(const char *data, std::size_t size) {
+    if (0 != KeyTraits::Size && size != KeyTraits::Size)
+      throw std::invalid_argument{"key of " + std::to_string(size) + " bytes in a tree of " + std::to_string(KeyTraits::Size) + " bytes keys"};
+
+    _bytes.append(data, size);
+    if (0 == KeyTraits::Size)
+      _sizes.push_back(static_cast<std::uint32_t>(size));
+  }
+
+  void push(const std::string& key) {
+    emplace(key.data(), key.size());
+  }
+
+  // copies the first key into `key` and drops it
+  void pop(std::string& key) {
+    auto size = frontSize();
+    key.assign(_bytes, _head, size);
+    drop(size);
+  }
+
+  void pop() {
+    drop(frontSize());
+  }
+
+private:
+  std::size_t frontSize() const {
+    return 0 != KeyTraits::Size ? KeyTraits::Size : _sizes[_sizesHead];
+  }
+
+  void drop(std::size_t size) {
+    _head += size;
+    if (0 == KeyTraits::Size)
+      ++_sizesHead;
+
+    if (empty()) {
+      _bytes.clear();
+      _head = 0;
+      _sizes.clear();
+      _sizesHead = 0;
+
+    } else if (_head >= CompactBytes && _head * 2 >= _bytes.size()) {
+      _bytes.erase(0, _head);
+      _head = 0;
+      _sizes.erase(_sizes.begin(), _sizes.begin() + _sizesHead);
+      _sizesHead = 0;
+    }
+  }
+};
+
+#endif // KEY_TRAITS_H
@@ -0,0 +1,223 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef LRU_CHILDREN_KEYS_CACHE_H
+#define LRU_CHILDREN_KEYS_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <iterator>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <unordered_map>
+
+#include "CachePolicy.h"
+#include "Helper.h"
+
+//
+// children keys cache bounded by a byte budget, split into shards with their own lock and LRU list
+//  each node's children are one flat array of sorted distances plus one buffer of concatenated keys
+//  copies take a snapshot of the cached entries and fill on their own from then on
+//
+class LRUChildrenKeysCache : public ConcurrentChildrenKeysCache {
+public:
+  struct Stats {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t evictions;
+    std::size_t entries;
+    std::size_t bytes;
+  };
+
+private:
+  struct Entry {
+    std::vector<std::uint32_t> distances;
+    // keys[offsets[i], offsets[i + 1]) pairs with distances[i]
+    std::vector<std::uint32_t> offsets;
+    std::string keys;
+    std::size_t charge;
+    std::list<std::string>::iterator recent;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    // most recently used first
+    std::list<std::string> recent;
+    std::size_t bytes = 0;
+
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+  };
+
+  struct Shards {
+    std::vector<Shard> shards;
+    std::size_t shardCapacity;
+
+    Shards(std::size_t capacityBytes, std::size_t count)
+      : shards(count)
+      , shardCapacity{ capacityBytes / count }
+    {}
+  };
+
+  // bookkeeping bytes of one entry besides its own arrays
+  static constexpr std::size_t EntryOverhead = 96;
+
+  std::shared_ptr<Shards> _shards;
+
+public:
+  explicit LRUChildrenKeysCache(std::size_t capacityBytes = 64 << 20, std::size_t shardCount = 16)
+    : _shards{ std::make_shared<Shards>(capacityBytes, std::max<std::size_t>(1, shardCount)) }
+  {}
+
+  // the entries and their recency are copied, the counters start over
+  LRUChildrenKeysCache(const LRUChildrenKeysCache& other)
+    : _shards{ std::make_shared<Shards>(other._shards->shardCapacity * other._shards->shards.size(), other._shards->shards.size()) }
+  {
+    for (std::size_t i = 0; i != _shards->shards.size(); ++i) {
+      auto& from = other._shards->shards[i];
+      auto& to = _shards->shards[i];
+
+      std::lock_guard<std::mutex> lock{from.mutex};
+      for (const auto& key : from.recent) {
+        auto entry = from.entries.at(key);
+        to.recent.push_back(key);
+        entry.recent = std::prev(to.recent.end());
+        to.entries.emplace(key, std::move(entry));
+      }
+
+      to.bytes = from.bytes;
+    }
+  }
+
+  LRUChildrenKeysCache(LRUChildrenKeysCache&&) = default;
+
+  LRUChildrenKeysCache& operator = (const LRUChildrenKeysCache& other) {
+    LRUChildrenKeysCache copy{other};
+    _shards = std::move(copy._shards);
+    return *this;
+  }
+
+  LRUChildrenKeysCache& operator = (LRUChildrenKeysCache&&) = default;
+
+public:
+  bool get(const std::string& key, std::queue<std::string>& keys, const std::pair<std::uint32_t, std::uint32_t>& range) {
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+
+    auto found = shard.entries.find(key);
+    if (found == shard.entries.end()) {
+      ++shard.misses;
+      return false;
+    }
+
+    ++shard.hits;
+
+    auto& entry = found->second;
+    shard.recent.splice(shard.recent.begin(), shard.recent, entry.recent);
+
+    const auto *distances = entry.distances.data();
+    auto lowerBound = Helper::lowerBound(distances, distances + entry.distances.size(), range.first) - distances;
+    auto upperBound = Helper::upperBound(distances, distances + entry.distances.size(), range.second) - distances;
+
+    for (auto i = lowerBound; i < upperBound; ++i) {
+      keys.emplace(entry.keys, entry.offsets[i], entry.offsets[i + 1] - entry.offsets[i]);
+    }
+
+    return true;
+  }
+
+  template<typename LoadSingleCallable, typename LoadAllCallable>
+  void update(const std::string& key, const std::vector<std::uint32_t>& distances, LoadSingleCallable&& loadChildKey, LoadAllCallable&& loadChildrenKeys) {
+    std::vector<std::string> childrenKeys;
+    loadChildrenKeys(key, childrenKeys);
+
+    if (childrenKeys.size() != distances.size())
+      throw std::logic_error{"children keys do not pair with children distances"};
+
+    Entry entry;
+    entry.distances = distances;
+    entry.offsets.reserve(childrenKeys.size() + 1);
+    entry.offsets.push_back(0);
+
+    for (const auto& childKey : childrenKeys) {
+      entry.keys += childKey;
+      entry.offsets.push_back(static_cast<std::uint32_t>(entry.keys.size()));
+    }
+
+    entry.charge = EntryOverhead + 2 * key.size() + entry.keys.size() + 
+                   (entry.distances.size() + entry.offsets.size()) * sizeof(std::uint32_t);
+
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+
+    erase(shard, key);
+
+    // an entry larger than the whole shard is never kept
+    if (entry.charge > _shards->shardCapacity)
+      return;
+
+    shard.recent.push_front(key);
+    entry.recent = shard.recent.begin();
+    shard.bytes += entry.charge;
+    shard.entries.emplace(key, std::move(entry));
+
+    while (shard.bytes > _shards->shardCapacity) {
+      auto leastRecent = shard.recent.back();
+      erase(shard, leastRecent);
+      ++shard.evictions;
+    }
+  }
+
+  void invalidate(const std::string& key) {
+    auto& shard = shardOf(key);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+
+    erase(shard, key);
+  }
+
+  Stats stats() const {
+    Stats stats{};
+
+    for (auto& shard : _shards->shards) {
+      std::lock_guard<std::mutex> lock{shard.mutex};
+
+      stats.hits += shard.hits;
+      stats.misses += shard.misses;
+      stats.evictions += shard.evictions;
+      stats.entries += shard.entries.size();
+      stats.bytes += shard.bytes;
+    }
+
+    return stats;
+  }
+
+private:
+  Shard& shardOf(const std::string& key) const {
+    return _shards->shards[std::hash<std::string>{}(key) % _shards->shards.size()];
+  }
+
+  static void erase(Shard& shard, const std::string& key) {
+    auto found = shard.entries.find(key);
+    if (found == shard.entries.end())
+      return;
+
+    shard.bytes -= found->second.charge;
+    shard.recent.erase(found->second.recent);
+    shard.entries.erase(found);
+  }
+};
+
+#endif // LRU_CHILDREN_KEYS_CACHE_H
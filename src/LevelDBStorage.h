@@ -0,0 +1,201 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef LEVELDB_STORAGE_H
+#define LEVELDB_STORAGE_H
+
+#include <leveldb/db.h>
+#include <leveldb/cache.h>
+#include <leveldb/iterator.h>
+#include <leveldb/write_batch.h>
+#include <leveldb/filter_policy.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+#include "StoragePolicy.h"
+
+//
+// default storage, one LevelDB database per storage
+//
+class LevelDBStorage {
+public:
+  using Snapshot = const leveldb::Snapshot *;
+
+  //
+  // tuning of one database, the defaults are the ones of LevelDB
+  //  index reads are small random point lookups, a bloom filter saves the table reads of missing keys
+  //  value reads happen on hits only and are cached like index reads, scans never fill the cache
+  //
+  struct Options {
+    // shared by every storage given the same cache, LevelDB keeps its own 8MB cache per database if null
+    std::shared_ptr<leveldb::Cache> blockCache;
+    // bits per key of a bloom filter, 0 stores no filter
+    int bloomBitsPerKey = 0;
+
+    std::size_t writeBufferSize = 4 << 20;
+    std::size_t blockSize = 4096;
+    int maxOpenFiles = 1000;
+    leveldb::CompressionType compression = leveldb::kSnappyCompression;
+
+    // whether blocks read by get and multiGet are kept in the block cache, scans never fill it
+    bool fillCache = true;
+    // whether each write waits until its log reaches the disk
+    bool sync = false;
+
+    static std::shared_ptr<leveldb::Cache> sharedCache(std::size_t capacity) {
+      return std::shared_ptr<leveldb::Cache>{ leveldb::NewLRUCache(capacity) };
+    }
+
+    // point lookups of node records
+    static Options indexes(const std::shared_ptr<leveldb::Cache>& blockCache = nullptr) {
+      Options options;
+      options.blockCache = blockCache;
+      options.bloomBitsPerKey = 10;
+      return options;
+    }
+
+    // values read once per result, popular results stay cached
+    static Options values(const std::shared_ptr<leveldb::Cache>& blockCache = nullptr) {
+      Options options;
+      options.blockCache = blockCache;
+      return options;
+    }
+  };
+
+  class WriteBatch {
+    friend class LevelDBStorage;
+
+  private:
+    leveldb::WriteBatch _batch;
+
+  public:
+    void put(const std::string& key, const std::string& value) {
+      _batch.Put(key, value);
+    }
+
+    void remove(const std::string& key) {
+      _batch.Delete(key);
+    }
+  };
+
+private:
+  // released after the database
+  std::shared_ptr<leveldb::Cache> _blockCache;
+  std::unique_ptr<const leveldb::FilterPolicy> _filterPolicy;
+
+  std::unique_ptr<leveldb::DB> _db;
+  bool _fillCache;
+  bool _sync;
+
+public:
+  static std::shared_ptr<LevelDBStorage> open(const std::string& path) {
+    return open(path, Options{});
+  }
+
+  static std::shared_ptr<LevelDBStorage> open(const std::string& path, const Options& storageOptions) {
+    std::unique_ptr<const leveldb::FilterPolicy> filterPolicy;
+    if (storageOptions.bloomBitsPerKey > 0)
+      filterPolicy.reset(leveldb::NewBloomFilterPolicy(storageOptions.bloomBitsPerKey));
+
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.block_cache = storageOptions.blockCache.get();
+    options.filter_policy = filterPolicy.get();
+    options.write_buffer_size = storageOptions.writeBufferSize;
+    options.block_size = storageOptions.blockSize;
+    options.max_open_files = storageOptions.maxOpenFiles;
+    options.compression = storageOptions.compression;
+
+    leveldb::DB* db = nullptr;
+    auto status = leveldb::DB::Open(options, path, &db);
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+
+    auto storage = std::make_shared<LevelDBStorage>(db);
+    storage->_blockCache = storageOptions.blockCache;
+    storage->_filterPolicy = std::move(filterPolicy);
+    storage->_fillCache = storageOptions.fillCache;
+    storage->_sync = storageOptions.sync;
+
+    return storage;
+  }
+
+  // takes the ownership of `db`
+  explicit LevelDBStorage(leveldb::DB* db)
+    : _db{ db }
+    , _fillCache{ true }
+    , _sync{ false }
+  {}
+
+  leveldb::DB* db() const {
+    return _db.get();
+  }
+
+public:
+  bool get(const Snapshot& snapshot, const std::string& key, std::string& value) {
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot;
+    options.fill_cache = _fillCache;
+
+    auto status = _db->Get(options, key, &value);
+    if (status.ok())
+      return true;
+
+    if (status.IsNotFound())
+      return false;
+
+    throw std::runtime_error{status.ToString()};
+  }
+
+  void multiGet(const Snapshot& snapshot, const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.resize(keys.size());
+
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      found[i] = get(snapshot, keys[i], values[i]);
+    }
+  }
+
+  void write(WriteBatch& batch) {
+    leveldb::WriteOptions options;
+    options.sync = _sync;
+
+    auto status = _db->Write(options, &batch._batch);
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+  }
+
+  Snapshot snapshot() {
+    return _db->GetSnapshot();
+  }
+
+  void release(const Snapshot& snapshot) {
+    _db->ReleaseSnapshot(snapshot);
+  }
+
+  template<typename Callable>
+  void scan(const Snapshot& snapshot, const std::string& prefix, Callable&& callable) {
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot;
+    options.fill_cache = false;
+
+    std::unique_ptr<leveldb::Iterator> it{ _db->NewIterator(options) };
+
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+      callable(it->key().ToString(), it->value().ToString());
+    }
+
+    if (!it->status().ok())
+      throw std::runtime_error{it->status().ToString()};
+  }
+};
+
+#endif // LEVELDB_STORAGE_H
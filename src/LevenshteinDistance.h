@@ -9,34 +9,471 @@
 #ifndef LEVENSHTEINDISTANCE
 #define LEVENSHTEINDISTANCE
 
+#include <cstdint>
+#include <limits>
 #include <vector>
 #include <string>
 #include <algorithm>
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LEVENSHTEIN_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+//
+// bit-parallel Levenshtein distance (Myers 1999, Hyyro 2003)
+//  one 64-bit word covers 64 characters of the pattern, longer patterns are split into blocks of words
+//
+// bounded variants return maxDistance + 1 as soon as the distance must exceed maxDistance
+//  long keys with a narrow band fall back to Ukkonen's banded dynamic programming
+//
+// the batch variant runs one key per SIMD lane against a pattern of up to 64 characters
+//  the widest of AVX-512 / AVX2 / SSE4.2 kernels supported by the running CPU is selected once
+//
 class LevenshteinDistancePolicy {
 public:
   static constexpr const char Prefix = 'L';
 
 public:
-  // https://en.wikibooks.org/wiki/Algorithm_Implementation/Strings/Levenshtein_distance#C.2B.2B
+  //
+  // match bitmasks of a query key, built once per query and reused against every visited key
+  //
+  class Pattern {
+  private:
+    std::string _key;
+    std::size_t _size = 0;
+    std::size_t _words = 0;
+    std::vector<std::uint64_t> _masks;
+
+  public:
+    Pattern() = default;
+
+    explicit Pattern(const std::string& key) {
+      assign(key);
+    }
+
+    // the storage of the previous key is reused when it is large enough
+    void assign(const std::string& key) {
+      _key.assign(key);
+      _size = key.size();
+      _words = (key.size() + 63) / 64;
+      _masks.assign(_words * 256, 0);
+
+      for (std::size_t i = 0; i != key.size(); ++i) {
+        _masks[(i / 64) * 256 + static_cast<unsigned char>(key[i])] |= std::uint64_t{1} << (i % 64);
+      }
+    }
+
+    const std::string& key() const { return _key; }
+    std::size_t size() const { return _size; }
+    std::size_t words() const { return _words; }
+    const std::uint64_t *masks(std::size_t word) const { return _masks.data() + word * 256; }
+  };
+
+  //
+  // working rows of patterns longer than one word, kept by the caller to reuse them across keys
+  //
+  struct Scratch {
+    std::vector<std::uint64_t> vp;
+    std::vector<std::uint64_t> vn;
+    std::vector<std::uint32_t> row;
+  };
+
+public:
+  static Pattern prepare(const std::string& key) {
+    return Pattern{key};
+  }
+
+  static void prepare(const std::string& key, Pattern& pattern) {
+    pattern.assign(key);
+  }
+
   static std::uint32_t distance(const std::string& s1, const std::string& s2) {
-    auto len1 = s1.size();
-    auto len2 = s2.size();
+    return distance(s1, s2, std::numeric_limits<std::uint32_t>::max());
+  }
+
+  static std::uint32_t distance(const std::string& s1, const std::string& s2, std::uint32_t maxDistance) {
+    // the shorter one is the pattern
+    const auto& pattern = s1.size() <= s2.size() ? s1 : s2;
+    const auto& text = s1.size() <= s2.size() ? s2 : s1;
+
+    if (text.size() - pattern.size() > maxDistance)
+      return maxDistance + 1;
+
+    if (pattern.empty())
+      return text.size();
+
+    if (pattern.size() > 64) {
+      Scratch scratch;
+      if (isBandNarrow(pattern.size(), text.size(), maxDistance))
+        return banded(pattern, text, maxDistance, scratch);
+
+      return blocked(Pattern{pattern}, text, maxDistance, scratch);
+    }
+
+    std::uint64_t masks[256] = {};
+    for (std::size_t i = 0; i != pattern.size(); ++i) {
+      masks[static_cast<unsigned char>(pattern[i])] |= std::uint64_t{1} << i;
+    }
+
+    return singleWord(masks, pattern.size(), text, maxDistance);
+  }
+
+  static std::uint32_t distance(const Pattern& pattern, const std::string& text) {
+    return distance(pattern, text, std::numeric_limits<std::uint32_t>::max());
+  }
+
+  static std::uint32_t distance(const Pattern& pattern, const std::string& text, std::uint32_t maxDistance) {
+    Scratch scratch;
+    return distance(pattern, text, maxDistance, scratch);
+  }
+
+  static std::uint32_t distance(const Pattern& pattern, const std::string& text, std::uint32_t maxDistance, Scratch& scratch) {
+    auto lengthDiff = pattern.size() < text.size() ? text.size() - pattern.size() : pattern.size() - text.size();
+    if (lengthDiff > maxDistance)
+      return maxDistance + 1;
+
+    if (0 == pattern.size())
+      return text.size();
+
+    if (1 == pattern.words())
+      return singleWord(pattern.masks(0), pattern.size(), text, maxDistance);
+
+    if (isBandNarrow(pattern.size(), text.size(), maxDistance))
+      return banded(pattern.key(), text, maxDistance, scratch);
+
+    return blocked(pattern, text, maxDistance, scratch);
+  }
+
+  static void distance(const Pattern& pattern, const std::vector<std::string>& keys, const std::vector<std::uint32_t>& maxDistances, std::vector<std::uint32_t>& distances) {
+    distances.resize(keys.size());
+
+    if (1 != pattern.words()) {
+      Scratch scratch;
+      for (std::size_t i = 0; i != keys.size(); ++i) {
+        distances[i] = distance(pattern, keys[i], maxDistances[i], scratch);
+      }
+      return;
+    }
+
+    // lanes always compute the exact distance which satisfies any bound
+    batchKernel()(pattern.masks(0), pattern.size(), keys.data(), keys.size(), distances.data());
+  }
+
+private:
+  using BatchKernel = void (*)(const std::uint64_t *, std::size_t, const std::string *, std::size_t, std::uint32_t *);
+
+  static BatchKernel batchKernel() {
+    static const BatchKernel kernel = selectBatchKernel();
+    return kernel;
+  }
+
+  static BatchKernel selectBatchKernel() {
+#ifdef LEVENSHTEIN_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+      return &batchAVX512;
+    if (__builtin_cpu_supports("avx2"))
+      return &batchAVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+      return &batchSSE42;
+#endif
+    return &batchScalar;
+  }
+
+public:
+  //
+  // batch kernels, public so each one the running CPU supports can be checked against batchScalar
+  //  keys of any length against a pattern of 1 to 64 characters, one exact distance per key
+  //
+  static void batchScalar(const std::uint64_t *masks, std::size_t size, const std::string *keys, std::size_t count, std::uint32_t *distances) {
+    for (std::size_t i = 0; i != count; ++i) {
+      distances[i] = singleWord(masks, size, keys[i], std::numeric_limits<std::uint32_t>::max());
+    }
+  }
+
+#ifdef LEVENSHTEIN_X86_KERNELS
+  // match bitmask of the j-th character of a lane key, lanes past their key end get zero
+  static std::uint64_t laneMask(const std::uint64_t *masks, const std::string *key, std::size_t j) {
+    return key && j < key->size() ? masks[static_cast<unsigned char>((*key)[j])] : 0;
+  }
+
+  __attribute__((target("avx512f")))
+  static void batchAVX512(const std::uint64_t *masks, std::size_t size, const std::string *keys, std::size_t count, std::uint32_t *distances) {
+    const __m512i ones = _mm512_set1_epi64(-1);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i last = _mm512_set1_epi64(static_cast<long long>(std::uint64_t{1} << (size - 1)));
+    const __m128i lastShift = _mm_cvtsi32_si128(static_cast<int>(size - 1));
+
+    for (std::size_t group = 0; group < count; group += 8) {
+      const std::string *lane[8] = {};
+      long long lengths[8] = {};
+      std::size_t maxLength = 0;
+
+      for (std::size_t l = 0; l != 8 && group + l < count; ++l) {
+        lane[l] = keys + group + l;
+        lengths[l] = static_cast<long long>(lane[l]->size());
+        maxLength = std::max(maxLength, lane[l]->size());
+      }
+
+      const __m512i laneLengths = _mm512_loadu_si512(lengths);
+      __m512i vp = ones;
+      __m512i vn = _mm512_setzero_si512();
+      __m512i score = _mm512_set1_epi64(static_cast<long long>(size));
+
+      for (std::size_t j = 0; j != maxLength; ++j) {
+        __m512i eq = _mm512_set_epi64(laneMask(masks, lane[7], j), laneMask(masks, lane[6], j), laneMask(masks, lane[5], j), laneMask(masks, lane[4], j),
+                                      laneMask(masks, lane[3], j), laneMask(masks, lane[2], j), laneMask(masks, lane[1], j), laneMask(masks, lane[0], j));
+        __mmask8 active = _mm512_cmpgt_epi64_mask(laneLengths, _mm512_set1_epi64(static_cast<long long>(j)));
+
+        __m512i x = _mm512_or_si512(eq, vn);
+        __m512i d0 = _mm512_or_si512(_mm512_xor_si512(_mm512_add_epi64(_mm512_and_si512(x, vp), vp), vp), x);
+        __m512i hp = _mm512_or_si512(vn, _mm512_andnot_si512(_mm512_or_si512(d0, vp), ones));
+        __m512i hn = _mm512_and_si512(d0, vp);
+
+        __m512i nextScore = _mm512_sub_epi64(_mm512_add_epi64(score, _mm512_srl_epi64(_mm512_and_si512(hp, last), lastShift)),
+                                             _mm512_srl_epi64(_mm512_and_si512(hn, last), lastShift));
+
+        hp = _mm512_or_si512(_mm512_slli_epi64(hp, 1), one);
+        hn = _mm512_slli_epi64(hn, 1);
+
+        score = _mm512_mask_blend_epi64(active, score, nextScore);
+        vp = _mm512_mask_blend_epi64(active, vp, _mm512_or_si512(hn, _mm512_andnot_si512(_mm512_or_si512(d0, hp), ones)));
+        vn = _mm512_mask_blend_epi64(active, vn, _mm512_and_si512(hp, d0));
+      }
+
+      long long scores[8];
+      _mm512_storeu_si512(scores, score);
+      for (std::size_t l = 0; l != 8 && group + l < count; ++l) {
+        distances[group + l] = static_cast<std::uint32_t>(scores[l]);
+      }
+    }
+  }
+
+  __attribute__((target("avx2")))
+  static void batchAVX2(const std::uint64_t *masks, std::size_t size, const std::string *keys, std::size_t count, std::uint32_t *distances) {
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i last = _mm256_set1_epi64x(static_cast<long long>(std::uint64_t{1} << (size - 1)));
+    const __m128i lastShift = _mm_cvtsi32_si128(static_cast<int>(size - 1));
+
+    for (std::size_t group = 0; group < count; group += 4) {
+      const std::string *lane[4] = {};
+      long long lengths[4] = {};
+      std::size_t maxLength = 0;
+
+      for (std::size_t l = 0; l != 4 && group + l < count; ++l) {
+        lane[l] = keys + group + l;
+        lengths[l] = static_cast<long long>(lane[l]->size());
+        maxLength = std::max(maxLength, lane[l]->size());
+      }
+
+      const __m256i laneLengths = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lengths));
+      __m256i vp = ones;
+      __m256i vn = _mm256_setzero_si256();
+      __m256i score = _mm256_set1_epi64x(static_cast<long long>(size));
+
+      for (std::size_t j = 0; j != maxLength; ++j) {
+        __m256i eq = _mm256_set_epi64x(laneMask(masks, lane[3], j), laneMask(masks, lane[2], j), laneMask(masks, lane[1], j), laneMask(masks, lane[0], j));
+        __m256i active = _mm256_cmpgt_epi64(laneLengths, _mm256_set1_epi64x(static_cast<long long>(j)));
+
+        __m256i x = _mm256_or_si256(eq, vn);
+        __m256i d0 = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi64(_mm256_and_si256(x, vp), vp), vp), x);
+        __m256i hp = _mm256_or_si256(vn, _mm256_andnot_si256(_mm256_or_si256(d0, vp), ones));
+        __m256i hn = _mm256_and_si256(d0, vp);
+
+        __m256i nextScore = _mm256_sub_epi64(_mm256_add_epi64(score, _mm256_srl_epi64(_mm256_and_si256(hp, last), lastShift)),
+                                             _mm256_srl_epi64(_mm256_and_si256(hn, last), lastShift));
+
+        hp = _mm256_or_si256(_mm256_slli_epi64(hp, 1), one);
+        hn = _mm256_slli_epi64(hn, 1);
+
+        score = _mm256_blendv_epi8(score, nextScore, active);
+        vp = _mm256_blendv_epi8(vp, _mm256_or_si256(hn, _mm256_andnot_si256(_mm256_or_si256(d0, hp), ones)), active);
+        vn = _mm256_blendv_epi8(vn, _mm256_and_si256(hp, d0), active);
+      }
+
+      long long scores[4];
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(scores), score);
+      for (std::size_t l = 0; l != 4 && group + l < count; ++l) {
+        distances[group + l] = static_cast<std::uint32_t>(scores[l]);
+      }
+    }
+  }
+
+  __attribute__((target("sse4.2")))
+  static void batchSSE42(const std::uint64_t *masks, std::size_t size, const std::string *keys, std::size_t count, std::uint32_t *distances) {
+    const __m128i ones = _mm_set1_epi64x(-1);
+    const __m128i one = _mm_set1_epi64x(1);
+    const __m128i last = _mm_set1_epi64x(static_cast<long long>(std::uint64_t{1} << (size - 1)));
+    const __m128i lastShift = _mm_cvtsi32_si128(static_cast<int>(size - 1));
+
+    for (std::size_t group = 0; group < count; group += 2) {
+      const std::string *lane[2] = {};
+      long long lengths[2] = {};
+      std::size_t maxLength = 0;
+
+      for (std::size_t l = 0; l != 2 && group + l < count; ++l) {
+        lane[l] = keys + group + l;
+        lengths[l] = static_cast<long long>(lane[l]->size());
+        maxLength = std::max(maxLength, lane[l]->size());
+      }
+
+      const __m128i laneLengths = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lengths));
+      __m128i vp = ones;
+      __m128i vn = _mm_setzero_si128();
+      __m128i score = _mm_set1_epi64x(static_cast<long long>(size));
+
+      for (std::size_t j = 0; j != maxLength; ++j) {
+        __m128i eq = _mm_set_epi64x(laneMask(masks, lane[1], j), laneMask(masks, lane[0], j));
+        __m128i active = _mm_cmpgt_epi64(laneLengths, _mm_set1_epi64x(static_cast<long long>(j)));
+
+        __m128i x = _mm_or_si128(eq, vn);
+        __m128i d0 = _mm_or_si128(_mm_xor_si128(_mm_add_epi64(_mm_and_si128(x, vp), vp), vp), x);
+        __m128i hp = _mm_or_si128(vn, _mm_andnot_si128(_mm_or_si128(d0, vp), ones));
+        __m128i hn = _mm_and_si128(d0, vp);
+
+        __m128i nextScore = _mm_sub_epi64(_mm_add_epi64(score, _mm_srl_epi64(_mm_and_si128(hp, last), lastShift)),
+                                          _mm_srl_epi64(_mm_and_si128(hn, last), lastShift));
+
+        hp = _mm_or_si128(_mm_slli_epi64(hp, 1), one);
+        hn = _mm_slli_epi64(hn, 1);
+
+        score = _mm_blendv_epi8(score, nextScore, active);
+        vp = _mm_blendv_epi8(vp, _mm_or_si128(hn, _mm_andnot_si128(_mm_or_si128(d0, hp), ones)), active);
+        vn = _mm_blendv_epi8(vn, _mm_and_si128(hp, d0), active);
+      }
+
+      long long scores[2];
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(scores), score);
+      for (std::size_t l = 0; l != 2 && group + l < count; ++l) {
+        distances[group + l] = static_cast<std::uint32_t>(scores[l]);
+      }
+    }
+  }
+#endif
+
+private:
+  // the band costs about one word step per 8 cells
+  static bool isBandNarrow(std::size_t patternSize, std::size_t textSize, std::uint32_t maxDistance) {
+    return maxDistance < std::max(patternSize, textSize) && 
+           2 * std::uint64_t{maxDistance} + 1 < (patternSize + 63) / 64 * 8;
+  }
+
+  // the final distance is at least the current last row value minus the remaining text characters
+  static bool exceeds(std::uint32_t score, std::size_t remaining, std::uint32_t maxDistance) {
+    return score > std::uint64_t{maxDistance} + remaining;
+  }
+
+  static std::uint32_t singleWord(const std::uint64_t *masks, std::size_t size, const std::string& text, std::uint32_t maxDistance) {
+    const std::uint64_t last = std::uint64_t{1} << (size - 1);
+
+    std::uint64_t vp = ~std::uint64_t{0};
+    std::uint64_t vn = 0;
+    std::uint32_t score = size;
+    std::size_t remaining = text.size();
+
+    for (unsigned char c : text) {
+      std::uint64_t x = masks[c] | vn;
+      std::uint64_t d0 = (((x & vp) + vp) ^ vp) | x;
+      std::uint64_t hp = vn | ~(d0 | vp);
+      std::uint64_t hn = d0 & vp;
+
+      score += (hp & last) != 0;
+      score -= (hn & last) != 0;
+
+      hp = (hp << 1) | 1;
+      hn = hn << 1;
+
+      vp = hn | ~(d0 | hp);
+      vn = hp & d0;
+
+      if (exceeds(score, --remaining, maxDistance))
+        return maxDistance + 1;
+    }
+
+    return score;
+  }
+
+  static std::uint32_t blocked(const Pattern& pattern, const std::string& text, std::uint32_t maxDistance, Scratch& scratch) {
+    const std::size_t words = pattern.words();
+    const std::uint64_t last = std::uint64_t{1} << ((pattern.size() - 1) % 64);
+
+    auto& vp = scratch.vp;
+    auto& vn = scratch.vn;
+    vp.assign(words, ~std::uint64_t{0});
+    vn.assign(words, 0);
+    std::uint32_t score = pattern.size();
+    std::size_t remaining = text.size();
+
+    for (unsigned char c : text) {
+      // horizontal deltas carried from the lower block into the next one
+      std::uint64_t hpCarry = 1;
+      std::uint64_t hnCarry = 0;
+
+      for (std::size_t w = 0; w != words; ++w) {
+        std::uint64_t x = pattern.masks(w)[c] | hnCarry;
+        std::uint64_t d0 = (((x & vp[w]) + vp[w]) ^ vp[w]) | x | vn[w];
+        std::uint64_t hp = vn[w] | ~(d0 | vp[w]);
+        std::uint64_t hn = d0 & vp[w];
+
+        if (w + 1 == words) {
+          score += (hp & last) != 0;
+          score -= (hn & last) != 0;
+        }
+
+        std::uint64_t hpOut = hp >> 63;
+        std::uint64_t hnOut = hn >> 63;
+        hp = (hp << 1) | hpCarry;
+        hn = (hn << 1) | hnCarry;
+        hpCarry = hpOut;
+        hnCarry = hnOut;
+
+        vp[w] = hn | ~(d0 | hp);
+        vn[w] = hp & d0;
+      }
+
+      if (exceeds(score, --remaining, maxDistance))
+        return maxDistance + 1;
+    }
+
+    return score;
+  }
+
+  // only cells within maxDistance of the diagonal are computed, cells outside the band count as maxDistance + 1
+  static std::uint32_t banded(const std::string& s1, const std::string& s2, std::uint32_t maxDistance, Scratch& scratch) {
+    const std::uint32_t outside = maxDistance + 1;
+
+    auto& row = scratch.row;
+    row.resize(s2.size() + 1);
+    for (std::size_t j = 0; j != row.size(); ++j)
+      row[j] = j <= maxDistance ? j : outside;
+
+    for (std::size_t i = 1; i <= s1.size(); ++i) {
+      std::size_t first = i > maxDistance ? i - maxDistance : 1;
+      std::size_t last = std::min(s2.size(), i + maxDistance);
+
+      std::uint32_t diagonal = row[first - 1];
+      row[first - 1] = (1 == first && i <= maxDistance) ? i : outside;
+
+      std::uint32_t rowMin = row[first - 1];
+
+      for (std::size_t j = first; j <= last; ++j) {
+        std::uint32_t up = row[j];
+        std::uint32_t cell = std::min({ up + 1, row[j - 1] + 1, diagonal + (s1[i - 1] == s2[j - 1] ? 0 : 1) });
+
+        diagonal = up;
+        row[j] = std::min(cell, outside);
+        rowMin = std::min(rowMin, row[j]);
+      }
 
-    std::vector<std::uint32_t> col(len2 + 1);
-    std::vector<std::uint32_t> prevCol(len2 + 1);
-  
-    for (std::size_t i = 0; i != prevCol.size(); ++i)
-      prevCol[i] = i;
-    for (std::size_t i = 0; i != len1; ++i) {
-      col[0] = i + 1;
-      for (std::size_t j = 0; j != len2; ++j)
-        col[j + 1] = std::min({ prevCol[1 + j] + 1, col[j] + 1, prevCol[j] + (s1[i]==s2[j] ? 0 : 1) });
-      col.swap(prevCol);
+      if (rowMin > maxDistance)
+        return outside;
     }
 
-    return prevCol[len2];
+    return std::min(row[s2.size()], outside);
   }
 };
 
-#endif // LEVENSHTEINDISTANCE
\ No newline at end of file
+#endif // LEVENSHTEINDISTANCE
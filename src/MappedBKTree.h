@@ -0,0 +1,355 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef MAPPED_BKTREE_H
+#define MAPPED_BKTREE_H
+
+#include <set>
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Helper.h"
+#include "MappedFile.h"
+#include "DistancePolicyTraits.h"
+
+//
+// snapshot of a whole tree in one immutable file, written by MappedBKTreeWriter::write and read by MappedBKTree
+//
+// [header]                                  MappedBKTreeHeader
+// [value heap]                              values one after another
+// [slots]                                   one MappedBKTreeSlot per node, in breadth-first order from the root
+// [distances]                               uint32 per node, its distance to its parent
+// [key heap]                                keys in slot order
+//
+// the children of a node are the consecutive slots [firstChild, firstChild + childCount) in ascending distance,
+// so their distances are one sorted run of [distances] and siblings visited together lie next to each other
+// numbers are in the byte order of the writing host, a host of the other order refuses the file
+//
+struct MappedBKTreeHeader {
+  static constexpr std::uint64_t Magic = 0x31656572746b6230ULL;
+  static constexpr std::uint32_t ByteOrder = 0x01020304;
+  static constexpr std::uint32_t Version = 1;
+
+  std::uint64_t magic;
+  std::uint32_t byteOrder;
+  std::uint32_t version;
+  std::uint64_t nodes;
+  std::uint64_t slotsOffset;
+  std::uint64_t distancesOffset;
+  std::uint64_t keysOffset;
+  std::uint64_t keysSize;
+  std::uint64_t valuesOffset;
+};
+
+struct MappedBKTreeSlot {
+  // value offset of erased keys, their nodes only route traversals
+  static constexpr std::uint64_t Erased = std::numeric_limits<std::uint64_t>::max();
+
+  // within the key heap and the value heap
+  std::uint64_t keyOffset;
+  std::uint64_t valueOffset;
+  std::uint32_t keySize;
+  std::uint32_t valueSize;
+  std::uint32_t firstChild;
+  std::uint32_t childCount;
+};
+
+//
+// nodes are added in breadth-first order, the children of each node in ascending distance
+// values are streamed to the file, slots, distances and keys are kept in memory until finish()
+//
+class MappedBKTreeWriter {
+private:
+  const std::string _path;
+  std::ofstream _out;
+
+  std::vector<MappedBKTreeSlot> _slots;
+  std::vector<std::uint32_t> _distances;
+  std::string _keys;
+
+  std::uint64_t _valuesSize = 0;
+  // first slot not yet claimed as a child
+  std::uint64_t _nextChild = 1;
+
+public:
+  // the current view of a BKTree, nodes read through BKTree::scanNodes
+  template<typename Tree>
+  static void write(Tree& tree, const std::string& path) {
+    MappedBKTreeWriter writer{path};
+
+    tree.scanNodes([&writer](const std::string& key, std::uint32_t distance, const std::string *value, std::size_t children) {
+      writer.add(key, distance, value, children);
+    });
+
+    writer.finish();
+  }
+
+  explicit MappedBKTreeWriter(const std::string& path)
+    : _path{ path }
+    , _out{ path, std::ios::binary | std::ios::trunc }
+  {
+    if (!_out)
+      throw std::runtime_error{"cannot create " + path};
+
+    // written again by finish()
+    MappedBKTreeHeader header{};
+    _out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+
+  // `value` is null for erased keys
+  void add(const std::string& key, std::uint32_t distance, const std::string *value, std::size_t children) {
+    if (_nextChild + children > std::numeric_limits<std::uint32_t>::max())
+      throw std::runtime_error{"too many nodes for a mapped tree"};
+
+    if (key.size() > std::numeric_limits<std::uint32_t>::max() || (value && value->size() > std::numeric_limits<std::uint32_t>::max()))
+      throw std::runtime_error{"key or value too large for a mapped tree"};
+
+    MappedBKTreeSlot slot{};
+    slot.keyOffset = _keys.size();
+    slot.keySize = static_cast<std::uint32_t>(key.size());
+    slot.valueOffset = MappedBKTreeSlot::Erased;
+    slot.firstChild = static_cast<std::uint32_t>(_nextChild);
+    slot.childCount = static_cast<std::uint32_t>(children);
+
+    if (value) {
+      slot.valueOffset = _valuesSize;
+      slot.valueSize = static_cast<std::uint32_t>(value->size());
+
+      _out.write(value->data(), value->size());
+      _valuesSize += value->size();
+    }
+
+    _keys.append(key);
+    _slots.push_back(slot);
+    _distances.push_back(distance);
+    _nextChild += children;
+  }
+
+  void finish() {
+    // every node but the root is the child of one node added before
+    if (!_slots.empty() && _nextChild != _slots.size())
+      throw std::logic_error{"children added do not match the children announced"};
+
+    MappedBKTreeHeader header{};
+    header.magic = MappedBKTreeHeader::Magic;
+    header.byteOrder = MappedBKTreeHeader::ByteOrder;
+    header.version = MappedBKTreeHeader::Version;
+    header.nodes = _slots.size();
+    header.valuesOffset = sizeof(header);
+
+    // slots start 8 bytes aligned, distances right after them
+    header.slotsOffset = align(header.valuesOffset + _valuesSize);
+    pad(header.slotsOffset - header.valuesOffset - _valuesSize);
+    _out.write(reinterpret_cast<const char *>(_slots.data()), _slots.size() * sizeof(MappedBKTreeSlot));
+
+    header.distancesOffset = header.slotsOffset + _slots.size() * sizeof(MappedBKTreeSlot);
+    _out.write(reinterpret_cast<const char *>(_distances.data()), _distances.size() * sizeof(std::uint32_t));
+
+    header.keysOffset = header.distancesOffset + _distances.size() * sizeof(std::uint32_t);
+    header.keysSize = _keys.size();
+    _out.write(_keys.data(), _keys.size());
+
+    _out.seekp(0);
+    _out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    _out.close();
+
+    if (!_out)
+      throw std::runtime_error{"cannot write " + _path};
+  }
+
+private:
+  static std::uint64_t align(std::uint64_t offset) {
+    return (offset + 7) & ~std::uint64_t{7};
+  }
+
+  void pad(std::uint64_t size) {
+    static const char zeros[8] = {};
+    _out.write(zeros, static_cast<std::streamsize>(size));
+  }
+};
+
+//
+// read-only tree over a file written by MappedBKTreeWriter::write, opening it is a single mmap
+// radius queries read the mapping in place, a Traversal reused across queries keeps them from allocating
+//  once its buffers fit the longest key and widest level, for distance policies with a reusable pattern such as Levenshtein
+// query matches the values of BKTree::query on the exported view, visiting nodes in the same order
+//
+template<typename DistancePolicy>
+class MappedBKTree {
+private:
+  using SelfType = MappedBKTree<DistancePolicy>;
+
+public:
+  //
+  // key, value and distance of one match, pointing into the mapping
+  //
+  struct Match {
+    const char *key;
+    std::size_t keySize;
+    const char *value;
+    std::size_t valueSize;
+    std::uint32_t distance;
+  };
+
+  //
+  // buffers of one query at a time, reused by the next queries
+  //
+  class Traversal {
+    friend SelfType;
+
+  private:
+    // ranges of sibling slots still to visit, consumed from head
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> _pending;
+    std::size_t _head = 0;
+    // the key of the visited node, for distance policies taking strings
+    std::string _key;
+    // the prepared query key and the working buffers of its distances
+    ReusedQueryDistance<DistancePolicy> _queryDistance;
+  };
+
+private:
+  MappedFile _file;
+
+  std::uint64_t _nodes;
+  const MappedBKTreeSlot *_slots;
+  const std::uint32_t *_distances;
+  const char *_keys;
+  const char *_values;
+
+public:
+  static SelfType* New(const std::string& path) {
+    return new SelfType(MappedFile::open(path));
+  }
+
+protected:
+  explicit MappedBKTree(MappedFile file)
+    : _file{ std::move(file) }
+  {
+    const char *data = _file.data();
+    const std::size_t size = _file.size();
+
+    MappedBKTreeHeader header;
+    if (size < sizeof(header))
+      throw std::runtime_error{"not a mapped tree file"};
+
+    std::memcpy(&header, data, sizeof(header));
+
+    if (MappedBKTreeHeader::Magic != header.magic || MappedBKTreeHeader::ByteOrder != header.byteOrder)
+      throw std::runtime_error{"not a mapped tree file of this byte order"};
+
+    if (MappedBKTreeHeader::Version != header.version)
+      throw std::runtime_error{"unsupported mapped tree version " + std::to_string(header.version)};
+
+    const bool sized = header.slotsOffset % alignof(MappedBKTreeSlot) == 0
+      && header.slotsOffset <= size && header.nodes <= (size - header.slotsOffset) / sizeof(MappedBKTreeSlot)
+      && header.distancesOffset == header.slotsOffset + header.nodes * sizeof(MappedBKTreeSlot)
+      && header.keysOffset == header.distancesOffset + header.nodes * sizeof(std::uint32_t)
+      && header.keysOffset <= size && header.keysSize == size - header.keysOffset
+      && header.valuesOffset <= header.slotsOffset;
+
+    if (!sized)
+      throw std::runtime_error{"corrupted mapped tree file"};
+
+    _nodes = header.nodes;
+    _slots = reinterpret_cast<const MappedBKTreeSlot *>(data + header.slotsOffset);
+    _distances = reinterpret_cast<const std::uint32_t *>(data + header.distancesOffset);
+    _keys = data + header.keysOffset;
+    _values = data + header.valuesOffset;
+  }
+
+public:
+  MappedBKTree(const MappedBKTree&) = delete;
+  MappedBKTree& operator = (const MappedBKTree&) = delete;
+
+  // number of nodes, erased keys included
+  std::size_t size() const {
+    return static_cast<std::size_t>(_nodes);
+  }
+
+  template<typename ResultContainer = std::set<std::string>>
+  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit) {
+    return query<ResultContainer>(key, threshold, limit, threshold);
+  }
+
+  template<typename ResultContainer = std::set<std::string>>
+  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics) {
+    ResultContainer values;
+    Traversal traversal;
+
+    query(key, threshold, distanceMetrics, traversal, [&values, limit](const Match& match) {
+      values.emplace(match.value, match.valueSize);
+      return values.size() < limit;
+    });
+
+    return values;
+  }
+
+  //
+  // onMatch(const Match&) for every live key within distanceMetrics, the traversal stops once it returns false
+  // the file is only read, any number of queries may run at once with a Traversal each
+  //
+  template<typename Callable>
+  void query(const std::string& key, std::uint32_t threshold, std::uint32_t distanceMetrics, Traversal& traversal, Callable&& onMatch) const {
+    auto& pending = traversal._pending;
+    pending.clear();
+    traversal._head = 0;
+
+    if (0 == _nodes)
+      return;
+
+    auto& queryDistance = traversal._queryDistance;
+    queryDistance.reset(key);
+    pending.emplace_back(0, 1);
+
+    while (traversal._head != pending.size()) {
+      auto siblings = pending[traversal._head++];
+
+      for (auto n = siblings.first; n != siblings.second; ++n) {
+        const auto& slot = _slots[n];
+        checkSlot(slot);
+
+        const auto *first = _distances + slot.firstChild;
+        const auto *last = first + slot.childCount;
+
+        traversal._key.assign(_keys + slot.keyOffset, slot.keySize);
+        auto d = queryDistance(traversal._key, Helper::pruningBound(first, last, threshold, distanceMetrics));
+
+        if (d < distanceMetrics && MappedBKTreeSlot::Erased != slot.valueOffset) {
+          if (!onMatch(Match{ _keys + slot.keyOffset, slot.keySize, _values + slot.valueOffset, slot.valueSize, d }))
+            return;
+        }
+
+        auto range = Helper::childrenRange(first, last, d, threshold);
+        if (range.first != range.second)
+          pending.emplace_back(static_cast<std::uint32_t>(range.first - _distances), static_cast<std::uint32_t>(range.second - _distances));
+      }
+    }
+  }
+
+private:
+  void checkSlot(const MappedBKTreeSlot& slot) const {
+    const auto keysSize = static_cast<std::uint64_t>(_file.data() + _file.size() - _keys);
+    const auto valuesSize = static_cast<std::uint64_t>(reinterpret_cast<const char *>(_slots) - _values);
+
+    const bool valid = slot.firstChild <= _nodes && slot.childCount <= _nodes - slot.firstChild
+      && slot.keyOffset <= keysSize && slot.keySize <= keysSize - slot.keyOffset
+      && (MappedBKTreeSlot::Erased == slot.valueOffset || (slot.valueOffset <= valuesSize && slot.valueSize <= valuesSize - slot.valueOffset));
+
+    if (!valid)
+      throw std::runtime_error{"corrupted mapped tree node"};
+  }
+};
+
+#endif // MAPPED_BKTREE_H
@@ -0,0 +1,89 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <stdexcept>
+
+//
+// read-only mapping of a whole file, unmapped once its last owner is destroyed
+//  the file is closed right after mapping, empty files cannot be mapped
+//
+class MappedFile {
+private:
+  const char *_data;
+  std::size_t _size;
+
+public:
+  static MappedFile open(const std::string& path) {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error{"cannot open " + path};
+
+    struct stat fileStat;
+    if (0 != ::fstat(fd, &fileStat)) {
+      ::close(fd);
+      throw std::runtime_error{"cannot stat " + path};
+    }
+
+    auto size = static_cast<std::size_t>(fileStat.st_size);
+    void *data = size > 0 ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+      throw std::runtime_error{"cannot map " + path};
+
+    return MappedFile{ static_cast<const char *>(data), size };
+  }
+
+  MappedFile(MappedFile&& other) noexcept
+    : _data{ other._data }
+    , _size{ other._size }
+  {
+    other._data = nullptr;
+    other._size = 0;
+  }
+
+  MappedFile& operator = (MappedFile&& other) noexcept {
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+    return *this;
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator = (const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (_data)
+      ::munmap(const_cast<char *>(_data), _size);
+  }
+
+  const char *data() const {
+    return _data;
+  }
+
+  std::size_t size() const {
+    return _size;
+  }
+
+private:
+  MappedFile(const char *data, std::size_t size)
+    : _data{ data }
+    , _size{ size }
+  {}
+};
+
+#endif // MAPPED_FILE_H
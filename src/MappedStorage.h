@@ -0,0 +1,241 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef MAPPED_STORAGE_H
+#define MAPPED_STORAGE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Helper.h"
+#include "MappedFile.h"
+#include "StoragePolicy.h"
+
+//
+// read-only storage over one memory-mapped file, written once by build() from another storage
+//
+// [key length] [key] [value length] [value] ...    ascending keys, lengths are varints
+// [entry offset] ...                               uint64
+// [offsets position] [entries count] [magic]       uint64
+//
+// uint64 numbers are little endian, lookups binary search the offsets
+//
+class MappedStorage {
+public:
+  // a mapped file never changes
+  using Snapshot = std::uint64_t;
+
+  class WriteBatch {
+  public:
+    void put(const std::string&, const std::string&) {}
+    void remove(const std::string&) {}
+  };
+
+  static constexpr std::uint64_t Magic = 0x31657274656b6230ULL;
+
+private:
+  MappedFile _file;
+
+  const char *_offsets;
+  std::uint64_t _count;
+
+public:
+  static std::shared_ptr<MappedStorage> open(const std::string& path) {
+    return std::make_shared<MappedStorage>(MappedFile::open(path));
+  }
+
+  // writes every key of `source` visible at `snapshot`
+  template<typename SourceStorage>
+  static void build(const std::string& path, SourceStorage& source, const typename SourceStorage::Snapshot& snapshot = typename SourceStorage::Snapshot{}) {
+    std::ofstream out{path, std::ios::binary | std::ios::trunc};
+    if (!out)
+      throw std::runtime_error{"cannot create " + path};
+
+    std::vector<std::uint64_t> offsets;
+    std::uint64_t position = 0;
+    std::string entry;
+
+    source.scan(snapshot, std::string{}, [&](const std::string& key, const std::string& value) {
+      entry.clear();
+      Helper::appendVarint(entry, static_cast<std::uint32_t>(key.size()));
+      entry.append(key);
+      Helper::appendVarint(entry, static_cast<std::uint32_t>(value.size()));
+      entry.append(value);
+
+      offsets.push_back(position);
+      out.write(entry.data(), entry.size());
+      position += entry.size();
+    });
+
+    std::string tail;
+    for (auto offset : offsets) {
+      appendFixed64(tail, offset);
+    }
+
+    appendFixed64(tail, position);
+    appendFixed64(tail, offsets.size());
+    appendFixed64(tail, Magic);
+
+    out.write(tail.data(), tail.size());
+    out.close();
+
+    if (!out)
+      throw std::runtime_error{"cannot write " + path};
+  }
+
+  explicit MappedStorage(MappedFile file)
+    : _file{ std::move(file) }
+    , _offsets{ nullptr }
+    , _count{ 0 }
+  {
+    const char *data = _file.data();
+    const std::size_t size = _file.size();
+
+    const std::size_t footerSize = 3 * sizeof(std::uint64_t);
+
+    if (size < footerSize || Magic != parseFixed64(data + size - sizeof(std::uint64_t)))
+      throw std::runtime_error{"not a mapped storage file"};
+
+    auto position = parseFixed64(data + size - footerSize);
+    _count = parseFixed64(data + size - 2 * sizeof(std::uint64_t));
+
+    if (position > size - footerSize || _count != (size - footerSize - position) / sizeof(std::uint64_t))
+      throw std::runtime_error{"corrupted mapped storage file"};
+
+    _offsets = data + position;
+  }
+
+  MappedStorage(const MappedStorage&) = delete;
+  MappedStorage& operator = (const MappedStorage&) = delete;
+
+  std::size_t size() const {
+    return static_cast<std::size_t>(_count);
+  }
+
+public:
+  bool get(const Snapshot&, const std::string& key, std::string& value) {
+    std::uint64_t first = 0;
+
+    for (auto length = _count; length > 0; ) {
+      auto half = length / 2;
+
+      const char *entryKey = nullptr;
+      std::uint32_t entryKeySize = 0;
+      entryAt(first + half, entryKey, entryKeySize);
+
+      if (compare(entryKey, entryKeySize, key) < 0) {
+        first += half + 1;
+        length -= half + 1;
+      } else {
+        length = half;
+      }
+    }
+
+    if (first == _count)
+      return false;
+
+    const char *entryKey = nullptr;
+    std::uint32_t entryKeySize = 0;
+    entryAt(first, entryKey, entryKeySize);
+
+    if (0 != compare(entryKey, entryKeySize, key))
+      return false;
+
+    valueAt(entryKey + entryKeySize, value);
+    return true;
+  }
+
+  void multiGet(const Snapshot& snapshot, const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.resize(keys.size());
+
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      found[i] = get(snapshot, keys[i], values[i]);
+    }
+  }
+
+  void write(WriteBatch&) {
+    throw std::runtime_error{"mapped storage is read-only"};
+  }
+
+  Snapshot snapshot() {
+    return 0;
+  }
+
+  void release(const Snapshot&) {}
+
+  template<typename Callable>
+  void scan(const Snapshot&, const std::string& prefix, Callable&& callable) {
+    std::string value;
+
+    for (std::uint64_t i = 0; i != _count; ++i) {
+      const char *entryKey = nullptr;
+      std::uint32_t entryKeySize = 0;
+      entryAt(i, entryKey, entryKeySize);
+
+      if (entryKeySize < prefix.size() || 0 != std::memcmp(entryKey, prefix.data(), prefix.size()))
+        continue;
+
+      valueAt(entryKey + entryKeySize, value);
+      callable(std::string{entryKey, entryKeySize}, value);
+    }
+  }
+
+private:
+  void entryAt(std::uint64_t i, const char *& key, std::uint32_t& keySize) const {
+    auto offset = parseFixed64(_offsets + i * sizeof(std::uint64_t));
+    if (offset >= static_cast<std::uint64_t>(_offsets - _file.data()))
+      throw std::runtime_error{"corrupted mapped storage entry"};
+
+    const char *p = _file.data() + offset;
+    if (!Helper::parseVarint(p, _offsets, keySize) || keySize > static_cast<std::size_t>(_offsets - p))
+      throw std::runtime_error{"corrupted mapped storage entry"};
+
+    key = p;
+  }
+
+  // `p` points right after the key of an entry
+  void valueAt(const char *p, std::string& value) const {
+    std::uint32_t valueSize = 0;
+    if (!Helper::parseVarint(p, _offsets, valueSize) || valueSize > static_cast<std::size_t>(_offsets - p))
+      throw std::runtime_error{"corrupted mapped storage entry"};
+
+    value.assign(p, valueSize);
+  }
+
+  static int compare(const char *key, std::size_t keySize, const std::string& other) {
+    auto result = std::memcmp(key, other.data(), std::min(keySize, other.size()));
+    if (0 != result)
+      return result;
+
+    return keySize < other.size() ? -1 : (keySize > other.size() ? 1 : 0);
+  }
+
+  static void appendFixed64(std::string& out, std::uint64_t value) {
+    for (int i = 0; i != 8; ++i) {
+      out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+  }
+
+  static std::uint64_t parseFixed64(const char *p) {
+    std::uint64_t value = 0;
+    for (int i = 0; i != 8; ++i) {
+      value |= std::uint64_t{static_cast<unsigned char>(p[i])} << (8 * i);
+    }
+
+    return value;
+  }
+};
+
+#endif // MAPPED_STORAGE_H
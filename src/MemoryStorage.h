@@ -0,0 +1,173 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef MEMORY_STORAGE_H
+#define MEMORY_STORAGE_H
+
+#include <set>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <shared_mutex>
+
+#include "StoragePolicy.h"
+
+//
+// process local storage, to measure trees without I/O or to test them
+//  every key keeps the versions some snapshot can still read, each write is one sequence number
+//  versions no snapshot reads are dropped when their key is written again
+//
+class MemoryStorage {
+public:
+  // sequence number the snapshot reads at, 0 reads the latest
+  using Snapshot = std::uint64_t;
+
+  class WriteBatch {
+    friend class MemoryStorage;
+
+  private:
+    // value is empty for removals
+    std::vector<std::pair<std::string, std::unique_ptr<std::string>>> _writes;
+
+  public:
+    void put(const std::string& key, const std::string& value) {
+      _writes.emplace_back(key, std::unique_ptr<std::string>{ new std::string{value} });
+    }
+
+    void remove(const std::string& key) {
+      _writes.emplace_back(key, nullptr);
+    }
+  };
+
+private:
+  struct Version {
+    std::uint64_t sequence;
+    std::shared_ptr<const std::string> value;
+  };
+
+  mutable std::shared_timed_mutex _mutex;
+
+  // versions by ascending sequence
+  std::map<std::string, std::vector<Version>> _entries;
+  std::uint64_t _sequence;
+  std::multiset<std::uint64_t> _snapshots;
+
+public:
+  // every open creates an empty storage, `path` is not used
+  static std::shared_ptr<MemoryStorage> open(const std::string&) {
+    return std::make_shared<MemoryStorage>();
+  }
+
+  MemoryStorage()
+    : _sequence{ 1 }
+  {}
+
+public:
+  bool get(const Snapshot& snapshot, const std::string& key, std::string& value) {
+    std::shared_lock<std::shared_timed_mutex> lock{_mutex};
+
+    auto found = _entries.find(key);
+    if (found == _entries.end())
+      return false;
+
+    auto version = visible(found->second, 0 == snapshot ? _sequence : snapshot);
+    if (!version || !version->value)
+      return false;
+
+    value = *version->value;
+    return true;
+  }
+
+  void multiGet(const Snapshot& snapshot, const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.resize(keys.size());
+
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      found[i] = get(snapshot, keys[i], values[i]);
+    }
+  }
+
+  void write(WriteBatch& batch) {
+    std::lock_guard<std::shared_timed_mutex> lock{_mutex};
+
+    auto sequence = _sequence + 1;
+    auto oldest = _snapshots.empty() ? sequence : std::min(*_snapshots.begin(), sequence);
+
+    for (auto& write : batch._writes) {
+      auto& versions = _entries[write.first];
+      std::shared_ptr<const std::string> value{ std::move(write.second) };
+
+      if (!versions.empty() && versions.back().sequence == sequence) {
+        // written twice in the batch
+        versions.back().value = std::move(value);
+      } else {
+        versions.push_back(Version{ sequence, std::move(value) });
+      }
+
+      prune(versions, oldest);
+      if (versions.size() == 1 && !versions.front().value)
+        _entries.erase(write.first);
+    }
+
+    _sequence = sequence;
+  }
+
+  Snapshot snapshot() {
+    std::lock_guard<std::shared_timed_mutex> lock{_mutex};
+
+    _snapshots.insert(_sequence);
+    return _sequence;
+  }
+
+  void release(const Snapshot& snapshot) {
+    std::lock_guard<std::shared_timed_mutex> lock{_mutex};
+
+    auto found = _snapshots.find(snapshot);
+    if (found != _snapshots.end())
+      _snapshots.erase(found);
+  }
+
+  template<typename Callable>
+  void scan(const Snapshot& snapshot, const std::string& prefix, Callable&& callable) {
+    std::shared_lock<std::shared_timed_mutex> lock{_mutex};
+    auto sequence = 0 == snapshot ? _sequence : snapshot;
+
+    for (auto it = _entries.lower_bound(prefix); it != _entries.end() && 0 == it->first.compare(0, prefix.size(), prefix); ++it) {
+      auto version = visible(it->second, sequence);
+      if (version && version->value)
+        callable(it->first, *version->value);
+    }
+  }
+
+private:
+  static const Version *visible(const std::vector<Version>& versions, std::uint64_t sequence) {
+    for (auto it = versions.rbegin(); it != versions.rend(); ++it) {
+      if (it->sequence <= sequence)
+        return &*it;
+    }
+
+    return nullptr;
+  }
+
+  // keeps the latest version at or before `oldest` and every version after it
+  static void prune(std::vector<Version>& versions, std::uint64_t oldest) {
+    auto kept = versions.size();
+    while (kept > 1 && versions[kept - 1].sequence > oldest) {
+      --kept;
+    }
+
+    if (kept > 1)
+      versions.erase(versions.begin(), versions.begin() + (kept - 1));
+  }
+};
+
+#endif // MEMORY_STORAGE_H
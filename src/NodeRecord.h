@@ -0,0 +1,201 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef NODE_RECORD_H
+#define NODE_RECORD_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Helper.h"
+
+//
+// all children of one node, stored as a single value under NODE_KEY(key)
+//
+// [children count]
+// [distance] [distance - previous distance] ...    ascending
+// [key length] [key] ...                           in distance order
+//
+// every number is a varint
+//
+class NodeRecord {
+public:
+  // written under FORMAT_VERSION_KEY, the legacy layout has no version
+  static constexpr std::uint32_t FormatVersion = 2;
+
+  // ascending, distances[i] pairs with keys[i]
+  std::vector<std::uint32_t> distances;
+  std::vector<std::string> keys;
+
+public:
+  static NodeRecord decode(const std::string& encoded) {
+    NodeRecord record;
+
+    parse(encoded, record.distances, [&](std::size_t offset, std::size_t size) {
+      record.keys.emplace_back(encoded, offset, size);
+    });
+
+    return record;
+  }
+
+  // distances are decoded into the given vector, keys are reported as (offset, size) into the encoded record
+  template<typename KeyCallable>
+  static void parse(const std::string& encoded, std::vector<std::uint32_t>& distances, KeyCallable&& onKey) {
+    const char *begin = encoded.data();
+    const char *p = begin;
+    const char *limit = p + encoded.size();
+
+    std::uint32_t count = 0;
+    if (!Helper::parseVarint(p, limit, count) || count > encoded.size())
+      throw std::runtime_error{"corrupted node record"};
+
+    distances.resize(count);
+
+    std::uint32_t distance = 0;
+    for (auto& d : distances) {
+      std::uint32_t delta = 0;
+      if (!Helper::parseVarint(p, limit, delta))
+        throw std::runtime_error{"corrupted node record"};
+
+      d = distance += delta;
+    }
+
+    for (std::uint32_t i = 0; i != count; ++i) {
+      std::uint32_t size = 0;
+      if (!Helper::parseVarint(p, limit, size) || size > static_cast<std::size_t>(limit - p))
+        throw std::runtime_error{"corrupted node record"};
+
+      onKey(static_cast<std::size_t>(p - begin), static_cast<std::size_t>(size));
+      p += size;
+    }
+  }
+
+  std::string encode() const {
+    std::string encoded;
+    Helper::appendVarint(encoded, static_cast<std::uint32_t>(distances.size()));
+
+    std::uint32_t distance = 0;
+    for (auto d : distances) {
+      Helper::appendVarint(encoded, d - distance);
+      distance = d;
+    }
+
+    for (const auto& key : keys) {
+      Helper::appendVarint(encoded, static_cast<std::uint32_t>(key.size()));
+      encoded.append(key);
+    }
+
+    return encoded;
+  }
+
+  bool find(std::uint32_t distance, std::string& key) const {
+    auto found = Helper::lowerBound(distances.data(), distances.data() + distances.size(), distance);
+    if (found == distances.data() + distances.size() || *found != distance)
+      return false;
+
+    key = keys[found - distances.data()];
+    return true;
+  }
+
+  void insert(std::uint32_t distance, const std::string& key) {
+    auto pos = std::lower_bound(distances.begin(), distances.end(), distance) - distances.begin();
+
+    distances.insert(distances.begin() + pos, distance);
+    keys.insert(keys.begin() + pos, key);
+  }
+
+  void erase(std::uint32_t distance) {
+    auto found = std::lower_bound(distances.begin(), distances.end(), distance);
+    if (found == distances.end() || *found != distance)
+      return;
+
+    keys.erase(keys.begin() + (found - distances.begin()));
+    distances.erase(found);
+  }
+};
+
+//
+// read side view of one node record, children keys are not copied out of the record until selected
+//  the record buffer is the Get target and is kept with the decoded distances between loads,
+//  so a query reusing one instance per node slot allocates only when a record outgrows it
+//
+class NodeChildren {
+  std::string _record;
+  std::vector<std::uint32_t> _distances;
+  // key i is record[keys[i].first, keys[i].first + keys[i].second)
+  std::vector<std::pair<std::size_t, std::size_t>> _keys;
+
+public:
+  // filled by the loader, decode() must be called afterwards
+  std::string& record() {
+    return _record;
+  }
+
+  void decode() {
+    _keys.clear();
+
+    NodeRecord::parse(_record, _distances, [this](std::size_t offset, std::size_t size) {
+      _keys.emplace_back(offset, size);
+    });
+  }
+
+  void clear() {
+    _record.clear();
+    _distances.clear();
+    _keys.clear();
+  }
+
+  std::size_t size() const {
+    return _distances.size();
+  }
+
+  const std::vector<std::uint32_t>& distances() const {
+    return _distances;
+  }
+
+  const char *keyData(std::size_t i) const {
+    return _record.data() + _keys[i].first;
+  }
+
+  std::size_t keySize(std::size_t i) const {
+    return _keys[i].second;
+  }
+
+  // iterators into the record, as ChildrenKeysCache containers take them
+  std::string::const_iterator keyBegin(std::size_t i) const {
+    return _record.cbegin() + _keys[i].first;
+  }
+
+  std::string::const_iterator keyEnd(std::size_t i) const {
+    return keyBegin(i) + _keys[i].second;
+  }
+
+  std::string key(std::size_t i) const {
+    return std::string(keyData(i), keySize(i));
+  }
+
+  bool find(std::uint32_t distance, std::string& key) const {
+    auto found = Helper::lowerBound(_distances.data(), _distances.data() + _distances.size(), distance);
+    if (found == _distances.data() + _distances.size() || *found != distance)
+      return false;
+
+    key.assign(keyData(found - _distances.data()), keySize(found - _distances.data()));
+    return true;
+  }
+
+  // index range of the children within [d - threshold, d + threshold]
+  std::pair<std::size_t, std::size_t> range(std::uint32_t d, std::uint32_t threshold) const {
+    auto range = Helper::childrenRange(_distances.data(), _distances.data() + _distances.size(), d, threshold);
+
+    return std::make_pair(static_cast<std::size_t>(range.first - _distances.data()), static_cast<std::size_t>(range.second - _distances.data()));
+  }
+};
+
+#endif // NODE_RECORD_H
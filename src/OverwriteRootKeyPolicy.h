@@ -6,25 +6,26 @@
  * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
  */
 
-#include <leveldb/db.h>
-#include <leveldb/write_batch.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
 
 #include "Helper.h"
+#include "NodeRecord.h"
 
 // called before update root key indexes
 struct OverwriteValueOnlyPolicy {
-  static void overwrite(const std::shared_ptr<leveldb::DB>& indexesDB, const std::string&, const std::vector<std::uint32_t>&, leveldb::WriteBatch&) {
+  template<typename Storage>
+  static void overwrite(const std::shared_ptr<Storage>& indexesStorage, const std::string&, const std::vector<std::uint32_t>&, typename Storage::WriteBatch&) {
     // do nothing
   }
 };
 
 struct CleanRootKeyIndexesPolicy {
-  static void overwrite(const std::shared_ptr<leveldb::DB>&, const std::string& rootKey, const std::vector<std::uint32_t>& children, leveldb::WriteBatch& batch) {
-    batch.Put(CHILDREN_DISTANCES_KEY(rootKey), leveldb::Slice{});
-    batch.Put(CHILDREN_KEY(rootKey), leveldb::Slice{});
-
-    for (auto d : children) {
-      batch.Delete(CHILD_INDEX_KEY(rootKey, d));
-    }
+  template<typename Storage>
+  static void overwrite(const std::shared_ptr<Storage>&, const std::string& rootKey, const std::vector<std::uint32_t>& children, typename Storage::WriteBatch& batch) {
+    // children are all kept in the node record
+    batch.put(NODE_KEY(rootKey), NodeRecord{}.encode());
   }
 };
\ No newline at end of file
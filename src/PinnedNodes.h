@@ -0,0 +1,178 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef PINNED_NODES_H
+#define PINNED_NODES_H
+
+#include <queue>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "Helper.h"
+
+//
+// how much of the top of the tree is kept in memory
+//  levels counts the root as the first level, 0 pins nothing
+//  maxNodes caps the pinned nodes, the upper levels are pinned first
+//
+struct PinOptions {
+  std::uint32_t levels;
+  std::size_t maxNodes;
+
+  PinOptions(std::uint32_t levels = 0, std::size_t maxNodes = std::numeric_limits<std::size_t>::max())
+    : levels{ levels }
+    , maxNodes{ maxNodes }
+  {}
+};
+
+//
+// read-only copy of the top nodes, every pinned node carries all its children
+//  the children of node n are distances[first, first + count) paired with childKeys[first, first + count)
+//  keys are ids into one buffer of concatenated keys, a pinned child shares its key id with its node
+//
+class PinnedNodes {
+public:
+  struct Node {
+    std::uint32_t key;
+    std::uint32_t firstChild;
+    std::uint32_t childCount;
+  };
+
+private:
+  std::vector<Node> _nodes;
+  // node ids ordered by key
+  std::vector<std::uint32_t> _order;
+
+  std::vector<std::uint32_t> _distances;
+  std::vector<std::uint32_t> _childKeys;
+
+  // key i is keys[keyOffsets[i], keyOffsets[i + 1])
+  std::vector<std::uint32_t> _keyOffsets;
+  std::string _keys;
+
+public:
+  PinnedNodes()
+    : _keyOffsets{ 0 }
+  {}
+
+  std::size_t size() const {
+    return _nodes.size();
+  }
+
+  const Node *find(const std::string& key) const {
+    auto found = std::lower_bound(_order.begin(), _order.end(), key, [this](std::uint32_t node, const std::string& key) {
+      return compareKey(_nodes[node].key, key) < 0;
+    });
+
+    if (found != _order.end() && 0 == compareKey(_nodes[*found].key, key))
+      return &_nodes[*found];
+
+    return nullptr;
+  }
+
+  std::string key(std::uint32_t id) const {
+    return _keys.substr(_keyOffsets[id], _keyOffsets[id + 1] - _keyOffsets[id]);
+  }
+
+  const std::uint32_t *distancesBegin(const Node& node) const {
+    return _distances.data() + node.firstChild;
+  }
+
+  const std::uint32_t *distancesEnd(const Node& node) const {
+    return _distances.data() + node.firstChild + node.childCount;
+  }
+
+  std::string childKey(const Node& node, std::size_t i) const {
+    return key(_childKeys[node.firstChild + i]);
+  }
+
+  bool findChild(const Node& node, std::uint32_t distance, std::string& childKey) const {
+    auto found = Helper::lowerBound(distancesBegin(node), distancesEnd(node), distance);
+    if (found == distancesEnd(node) || *found != distance)
+      return false;
+
+    childKey = key(_childKeys[found - _distances.data()]);
+    return true;
+  }
+
+  // pending keys are anything with emplace(const char *, std::size_t), such as std::queue<std::string>
+  template<typename PendingKeys>
+  void selectChildren(const Node& node, std::uint32_t d, std::uint32_t threshold, PendingKeys& pendingKeys) const {
+    auto range = Helper::childrenRange(distancesBegin(node), distancesEnd(node), d, threshold);
+
+    for (; range.first != range.second; ++range.first) {
+      auto id = _childKeys[range.first - _distances.data()];
+      pendingKeys.emplace(_keys.data() + _keyOffsets[id], _keyOffsets[id + 1] - _keyOffsets[id]);
+    }
+  }
+
+  void children(const Node& node, std::vector<std::uint32_t>& distances, std::vector<std::string>& keys) const {
+    distances.assign(distancesBegin(node), distancesEnd(node));
+
+    keys.clear();
+    for (auto i = node.firstChild; i != node.firstChild + node.childCount; ++i) {
+      keys.push_back(key(_childKeys[i]));
+    }
+  }
+
+public:
+  //
+  // building, nodes are added parent first and sealed once all are added
+  //
+  std::uint32_t addKey(const std::string& key) {
+    _keys.append(key);
+    _keyOffsets.push_back(static_cast<std::uint32_t>(_keys.size()));
+
+    return static_cast<std::uint32_t>(_keyOffsets.size() - 2);
+  }
+
+  void addNode(std::uint32_t key, const std::vector<std::uint32_t>& distances, const std::vector<std::uint32_t>& childKeys) {
+    _nodes.push_back(Node{ key, static_cast<std::uint32_t>(_distances.size()), static_cast<std::uint32_t>(distances.size()) });
+
+    _distances.insert(_distances.end(), distances.begin(), distances.end());
+    _childKeys.insert(_childKeys.end(), childKeys.begin(), childKeys.end());
+  }
+
+  void seal() {
+    _order.resize(_nodes.size());
+    for (std::uint32_t i = 0; i != _order.size(); ++i) {
+      _order[i] = i;
+    }
+
+    std::sort(_order.begin(), _order.end(), [this](std::uint32_t left, std::uint32_t right) {
+      return compareKey(_nodes[left].key, _nodes[right].key) < 0;
+    });
+
+    _nodes.shrink_to_fit();
+    _distances.shrink_to_fit();
+    _childKeys.shrink_to_fit();
+    _keyOffsets.shrink_to_fit();
+    _keys.shrink_to_fit();
+  }
+
+private:
+  int compareKey(std::uint32_t id, const std::string& key) const {
+    return -key.compare(0, key.size(), _keys.data() + _keyOffsets[id], _keyOffsets[id + 1] - _keyOffsets[id]);
+  }
+
+  // the order of std::string::compare, without copying either key
+  int compareKey(std::uint32_t left, std::uint32_t right) const {
+    auto leftSize = _keyOffsets[left + 1] - _keyOffsets[left];
+    auto rightSize = _keyOffsets[right + 1] - _keyOffsets[right];
+
+    auto result = std::char_traits<char>::compare(_keys.data() + _keyOffsets[left], _keys.data() + _keyOffsets[right], std::min(leftSize, rightSize));
+    if (0 != result)
+      return result;
+
+    return leftSize < rightSize ? -1 : (leftSize > rightSize ? 1 : 0);
+  }
+};
+
+#endif // PINNED_NODES_H
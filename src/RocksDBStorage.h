@@ -0,0 +1,193 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef ROCKSDB_STORAGE_H
+#define ROCKSDB_STORAGE_H
+
+#include <rocksdb/db.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/table.h>
+#include <rocksdb/iterator.h>
+#include <rocksdb/write_batch.h>
+#include <rocksdb/filter_policy.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+#include "StoragePolicy.h"
+
+//
+// one RocksDB database per storage, only built when included
+//  MultiGet reads a batch of keys in one call and bloom filters skip tables without a key
+//
+class RocksDBStorage {
+public:
+  using Snapshot = const rocksdb::Snapshot *;
+
+  // tuning of one database, see LevelDBStorage::Options
+  struct Options {
+    std::shared_ptr<rocksdb::Cache> blockCache;
+    int bloomBitsPerKey = 10;
+
+    std::size_t writeBufferSize = 64 << 20;
+    rocksdb::CompressionType compression = rocksdb::kSnappyCompression;
+
+    bool fillCache = true;
+    // whether each write waits until its log reaches the disk
+    bool sync = false;
+
+    static std::shared_ptr<rocksdb::Cache> sharedCache(std::size_t capacity) {
+      return rocksdb::NewLRUCache(capacity);
+    }
+
+    static Options indexes(const std::shared_ptr<rocksdb::Cache>& blockCache = nullptr) {
+      Options options;
+      options.blockCache = blockCache;
+      return options;
+    }
+
+    static Options values(const std::shared_ptr<rocksdb::Cache>& blockCache = nullptr) {
+      Options options;
+      options.blockCache = blockCache;
+      options.bloomBitsPerKey = 0;
+      return options;
+    }
+  };
+
+  class WriteBatch {
+    friend class RocksDBStorage;
+
+  private:
+    rocksdb::WriteBatch _batch;
+
+  public:
+    void put(const std::string& key, const std::string& value) {
+      _batch.Put(key, value);
+    }
+
+    void remove(const std::string& key) {
+      _batch.Delete(key);
+    }
+  };
+
+private:
+  std::unique_ptr<rocksdb::DB> _db;
+  bool _fillCache;
+  bool _sync;
+
+public:
+  static std::shared_ptr<RocksDBStorage> open(const std::string& path) {
+    return open(path, Options{});
+  }
+
+  static std::shared_ptr<RocksDBStorage> open(const std::string& path, const Options& storageOptions) {
+    rocksdb::BlockBasedTableOptions tableOptions;
+    if (storageOptions.blockCache)
+      tableOptions.block_cache = storageOptions.blockCache;
+    if (storageOptions.bloomBitsPerKey > 0)
+      tableOptions.filter_policy.reset(rocksdb::NewBloomFilterPolicy(storageOptions.bloomBitsPerKey));
+
+    rocksdb::Options options;
+    options.create_if_missing = true;
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(tableOptions));
+    options.write_buffer_size = storageOptions.writeBufferSize;
+    options.compression = storageOptions.compression;
+
+    rocksdb::DB* db = nullptr;
+    auto status = rocksdb::DB::Open(options, path, &db);
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+
+    auto storage = std::make_shared<RocksDBStorage>(db);
+    storage->_fillCache = storageOptions.fillCache;
+    storage->_sync = storageOptions.sync;
+
+    return storage;
+  }
+
+  // takes the ownership of `db`
+  explicit RocksDBStorage(rocksdb::DB* db)
+    : _db{ db }
+    , _fillCache{ true }
+    , _sync{ false }
+  {}
+
+  rocksdb::DB* db() const {
+    return _db.get();
+  }
+
+public:
+  bool get(const Snapshot& snapshot, const std::string& key, std::string& value) {
+    rocksdb::ReadOptions options;
+    options.snapshot = snapshot;
+    options.fill_cache = _fillCache;
+
+    auto status = _db->Get(options, key, &value);
+    if (status.ok())
+      return true;
+
+    if (status.IsNotFound())
+      return false;
+
+    throw std::runtime_error{status.ToString()};
+  }
+
+  void multiGet(const Snapshot& snapshot, const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found) {
+    rocksdb::ReadOptions options;
+    options.snapshot = snapshot;
+    options.fill_cache = _fillCache;
+
+    std::vector<rocksdb::Slice> slices{ keys.begin(), keys.end() };
+    auto statuses = _db->MultiGet(options, slices, &values);
+
+    found.resize(keys.size());
+    for (std::size_t i = 0; i != statuses.size(); ++i) {
+      if (!statuses[i].ok() && !statuses[i].IsNotFound())
+        throw std::runtime_error{statuses[i].ToString()};
+
+      found[i] = statuses[i].ok();
+    }
+  }
+
+  void write(WriteBatch& batch) {
+    rocksdb::WriteOptions options;
+    options.sync = _sync;
+
+    auto status = _db->Write(options, &batch._batch);
+    if (!status.ok())
+      throw std::runtime_error{status.ToString()};
+  }
+
+  Snapshot snapshot() {
+    return _db->GetSnapshot();
+  }
+
+  void release(const Snapshot& snapshot) {
+    _db->ReleaseSnapshot(snapshot);
+  }
+
+  template<typename Callable>
+  void scan(const Snapshot& snapshot, const std::string& prefix, Callable&& callable) {
+    rocksdb::ReadOptions options;
+    options.snapshot = snapshot;
+    options.fill_cache = false;
+
+    std::unique_ptr<rocksdb::Iterator> it{ _db->NewIterator(options) };
+
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+      callable(it->key().ToString(), it->value().ToString());
+    }
+
+    if (!it->status().ok())
+      throw std::runtime_error{it->status().ToString()};
+  }
+};
+
+#endif // ROCKSDB_STORAGE_H
@@ -0,0 +1,295 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef SHARDED_BKTREE_H
+#define SHARDED_BKTREE_H
+
+#include <string>
+#include <set>
+#include <vector>
+#include <memory>
+#include <future>
+#include <tuple>
+#include <utility>
+#include <iterator>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "BKTree.h"
+#include "WorkStealingPool.h"
+
+//
+// keys hash-partitioned over independent trees, each with its own values and indexes storages
+//  writes to different shards run in parallel, each shard serializes its own writers
+//  query and nearest ask every shard on a pool of one thread per shard and merge the results
+//
+// a key always lands on the shard of its FNV-1a hash, so the shards are opened in the same order and number every time
+// the indexes of each shard remember their place and refuse to be opened as another shard
+//
+template<typename DistancePolicy,
+         typename CachePolicy = NoCachePolicy,
+         typename ChildrenKeyPolicy = DisableChildrenKey,
+         typename StoragePolicy = LevelDBStorage,
+         typename KeyTraits = VariableKeyTraits,
+         typename StatsPolicy = NoStatsPolicy>
+class ShardedBKTree {
+public:
+  using Tree = BKTree<DistancePolicy, CachePolicy, ChildrenKeyPolicy, StoragePolicy, KeyTraits, StatsPolicy>;
+  using Neighbour = typename Tree::Neighbour;
+
+private:
+  using SelfType = ShardedBKTree<DistancePolicy, CachePolicy, ChildrenKeyPolicy, StoragePolicy, KeyTraits, StatsPolicy>;
+  using Storage = StoragePolicy;
+  using Snapshot = typename Storage::Snapshot;
+
+private:
+  std::vector<std::unique_ptr<Tree>> _shards;
+  WorkStealingPool _pool;
+
+public:
+  //
+  // shard i keeps its values at paths[i] and its indexes at paths[i] + "_i", one path per disk spreads the writes
+  //
+  static SelfType* New(const std::vector<std::string>& paths, const PinOptions& pinning = PinOptions{}) {
+    if (paths.empty())
+      throw std::invalid_argument{"at least one shard"};
+
+    std::vector<std::unique_ptr<Tree>> shards;
+    for (std::size_t i = 0; i != paths.size(); ++i) {
+      auto valuesStorage = Storage::open(paths[i]);
+      auto indexesStorage = Storage::open(paths[i] + "_i");
+
+      CheckShard(*indexesStorage, i, paths.size());
+
+      std::unique_ptr<Tree> shard{ Tree::New(valuesStorage, indexesStorage, pinning) };
+      shards.push_back(std::move(shard));
+    }
+
+    return new SelfType(std::move(shards));
+  }
+
+  // shards at path + "_shard0", path + "_shard1", ...
+  static SelfType* New(const std::string& path, std::size_t shards, const PinOptions& pinning = PinOptions{}) {
+    std::vector<std::string> paths;
+    for (std::size_t i = 0; i != shards; ++i) {
+      paths.push_back(path + "_shard" + std::to_string(i));
+    }
+
+    return New(paths, pinning);
+  }
+
+protected:
+  explicit ShardedBKTree(std::vector<std::unique_ptr<Tree>>&& shards)
+    : _shards{ std::move(shards) }
+    , _pool{ _shards.size() }
+  {}
+
+public:
+  std::size_t size() const {
+    return _shards.size();
+  }
+
+  Tree& shard(std::size_t i) {
+    return *_shards[i];
+  }
+
+  Tree& shardOf(const std::string& key) {
+    return *_shards[hash(key) % _shards.size()];
+  }
+
+  template<class OverwriteRootKeyPolicy = CleanRootKeyIndexesPolicy>
+  void insert(const std::string& key, const std::string& value) {
+    shardOf(key).template insert<OverwriteRootKeyPolicy>(key, value);
+  }
+
+  // each shard writes its part as one batch, in parallel with the other shards
+  template<class OverwriteRootKeyPolicy = CleanRootKeyIndexesPolicy>
+  void insertBatch(const std::vector<std::pair<std::string, std::string>>& keyValues) {
+    auto parts = partition(keyValues.begin(), keyValues.end());
+
+    forEachShard([&](std::size_t i) {
+      _shards[i]->template insertBatch<OverwriteRootKeyPolicy>(parts[i]);
+    });
+  }
+
+  // the range is read `chunkSize` pairs at a time, each shard loads its part of a chunk in parallel with the other shards
+  template<class OverwriteRootKeyPolicy = CleanRootKeyIndexesPolicy, typename InputIterator>
+  void bulkLoad(InputIterator first, InputIterator last, std::size_t chunkSize = 1 << 16) {
+    if (0 == chunkSize)
+      throw std::invalid_argument{"chunk size must be positive"};
+
+    std::vector<std::vector<std::pair<std::string, std::string>>> parts(_shards.size());
+
+    while (first != last) {
+      for (std::size_t n = 0; n != chunkSize && first != last; ++n, ++first) {
+        const auto& keyValue = *first;
+        parts[hash(keyValue.first) % _shards.size()].emplace_back(keyValue.first, keyValue.second);
+      }
+
+      forEachShard([&](std::size_t i) {
+        if (!parts[i].empty())
+          _shards[i]->template bulkLoad<OverwriteRootKeyPolicy>(parts[i].begin(), parts[i].end(), chunkSize);
+      });
+
+      // the buffers keep their capacity for the next chunk
+      for (auto& part : parts) {
+        part.clear();
+      }
+    }
+  }
+
+  bool erase(const std::string& key) {
+    return shardOf(key).erase(key);
+  }
+
+  std::size_t compact() {
+    std::vector<std::size_t> reclaimed(_shards.size());
+
+    forEachShard([&](std::size_t i) {
+      reclaimed[i] = _shards[i]->compact();
+    });
+
+    std::size_t total = 0;
+    for (auto n : reclaimed) {
+      total += n;
+    }
+
+    return total;
+  }
+
+  template<typename ResultContainer = std::set<std::string>>
+  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit) {
+    return query<ResultContainer>(key, threshold, limit, threshold);
+  }
+
+  //
+  // every shard is asked for up to `limit` values, the values of the first shards are kept first
+  //
+  template<typename ResultContainer = std::set<std::string>>
+  ResultContainer query(const std::string& key, std::uint32_t threshold, std::uint32_t limit, std::uint32_t distanceMetrics) {
+    std::vector<ResultContainer> shardValues(_shards.size());
+
+    forEachShard([&](std::size_t i) {
+      shardValues[i] = _shards[i]->template query<ResultContainer>(key, threshold, limit, distanceMetrics);
+    });
+
+    ResultContainer values;
+    for (auto& part : shardValues) {
+      for (auto it = part.begin(); it != part.end() && values.size() < limit; ++it) {
+        values.emplace(*it);
+      }
+    }
+
+    return values;
+  }
+
+  //
+  // the k closest of the k closest keys of every shard, ascending by distance then key like BKTree::nearest
+  //
+  std::vector<Neighbour> nearest(const std::string& key, std::size_t k, std::uint32_t maxDistance = std::numeric_limits<std::uint32_t>::max()) {
+    std::vector<std::vector<Neighbour>> shardNeighbours(_shards.size());
+
+    forEachShard([&](std::size_t i) {
+      shardNeighbours[i] = _shards[i]->nearest(key, k, maxDistance);
+    });
+
+    std::vector<Neighbour> neighbours;
+    for (auto& part : shardNeighbours) {
+      std::move(part.begin(), part.end(), std::back_inserter(neighbours));
+    }
+
+    std::sort(neighbours.begin(), neighbours.end(), [](const Neighbour& left, const Neighbour& right) {
+      return std::tie(std::get<1>(left), std::get<0>(left)) < std::tie(std::get<1>(right), std::get<0>(right));
+    });
+
+    if (neighbours.size() > k)
+      neighbours.resize(k);
+
+    return neighbours;
+  }
+
+private:
+  static void CheckShard(Storage& indexesStorage, std::size_t shard, std::size_t shards) {
+    const auto place = std::to_string(shard) + "/" + std::to_string(shards);
+
+    std::string stored;
+    if (indexesStorage.get(Snapshot{}, SHARD_KEY, stored)) {
+      if (stored != place)
+        throw std::runtime_error{"indexes of shard " + stored + " opened as shard " + place};
+
+      return;
+    }
+
+    typename Storage::WriteBatch batch;
+    batch.put(SHARD_KEY, place);
+    indexesStorage.write(batch);
+  }
+
+  // FNV-1a, stable across platforms and runs unlike std::hash
+  static std::uint64_t hash(const std::string& key) {
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+      hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+
+    return hash;
+  }
+
+  template<typename InputIterator>
+  std::vector<std::vector<std::pair<std::string, std::string>>> partition(InputIterator first, InputIterator last) {
+    std::vector<std::vector<std::pair<std::string, std::string>>> parts(_shards.size());
+
+    for (; first != last; ++first) {
+      const auto& keyValue = *first;
+      parts[hash(keyValue.first) % _shards.size()].emplace_back(keyValue.first, keyValue.second);
+    }
+
+    return parts;
+  }
+
+  //
+  // callable(i) for every shard on the pool, returns once every call is done and rethrows the first error by shard
+  //
+  template<typename Callable>
+  void forEachShard(Callable&& callable) {
+    std::vector<std::future<void>> done;
+    done.reserve(_shards.size());
+
+    try {
+      for (std::size_t i = 0; i != _shards.size(); ++i) {
+        auto task = std::make_shared<std::packaged_task<void()>>([&callable, i]() {
+          callable(i);
+        });
+
+        done.push_back(task->get_future());
+        _pool.submit([task]() {
+          (*task)();
+        });
+      }
+    } catch (...) {
+      // submitted calls still reference the caller
+      for (auto& call : done) {
+        call.wait();
+      }
+
+      throw;
+    }
+
+    for (auto& call : done) {
+      call.wait();
+    }
+
+    for (auto& call : done) {
+      call.get();
+    }
+  }
+};
+
+#endif // SHARDED_BKTREE_H
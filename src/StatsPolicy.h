@@ -0,0 +1,246 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef STATS_POLICY_H
+#define STATS_POLICY_H
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+//
+// counters of one radius query, or the sum of many
+//
+struct QueryStats {
+  std::uint64_t queries = 0;
+  std::uint64_t nodesVisited = 0;
+
+  // keys read, a multiGet of n keys counts n
+  std::uint64_t indexGets = 0;
+  std::uint64_t indexGetNanoseconds = 0;
+  std::uint64_t valueGets = 0;
+  std::uint64_t valueGetNanoseconds = 0;
+
+  std::uint64_t distances = 0;
+  std::uint64_t distanceNanoseconds = 0;
+
+  // children keys cache lookups, see appendChildrenKeys
+  std::uint64_t cacheHits = 0;
+  std::uint64_t cacheMisses = 0;
+
+  // by depth from the root, children of the visited nodes and the ones left unvisited
+  // nodes served by the children keys cache are not counted, their children are not known
+  std::vector<std::uint64_t> levelChildren;
+  std::vector<std::uint64_t> levelPruned;
+
+  double prunedFraction(std::size_t depth) const {
+    if (depth >= levelChildren.size() || 0 == levelChildren[depth])
+      return 0.0;
+
+    return static_cast<double>(levelPruned[depth]) / levelChildren[depth];
+  }
+
+  QueryStats& operator += (const QueryStats& other) {
+    queries += other.queries;
+    nodesVisited += other.nodesVisited;
+    indexGets += other.indexGets;
+    indexGetNanoseconds += other.indexGetNanoseconds;
+    valueGets += other.valueGets;
+    valueGetNanoseconds += other.valueGetNanoseconds;
+    distances += other.distances;
+    distanceNanoseconds += other.distanceNanoseconds;
+    cacheHits += other.cacheHits;
+    cacheMisses += other.cacheMisses;
+
+    if (levelChildren.size() < other.levelChildren.size()) {
+      levelChildren.resize(other.levelChildren.size());
+      levelPruned.resize(other.levelChildren.size());
+    }
+
+    for (std::size_t depth = 0; depth != other.levelChildren.size(); ++depth) {
+      levelChildren[depth] += other.levelChildren[depth];
+      levelPruned[depth] += other.levelPruned[depth];
+    }
+
+    return *this;
+  }
+};
+
+//
+// shape of the tree, see BKTree::scanShape
+//
+struct TreeShape {
+  std::uint64_t nodes = 0;
+  // nodes by depth from the root
+  std::vector<std::uint64_t> depths;
+  // nodes by number of children
+  std::map<std::size_t, std::uint64_t> fanouts;
+
+  double meanFanout() const {
+    std::uint64_t children = 0;
+    for (const auto& fanout : fanouts) {
+      children += fanout.first * fanout.second;
+    }
+
+    return 0 == nodes ? 0.0 : static_cast<double>(children) / nodes;
+  }
+};
+
+//
+// StatsPolicy requires
+//	class Recorder
+//    counters of one traversal, every call is made by the thread owning the recorder
+//	  using Timer, Timer start()
+//	  void indexGets(std::size_t count, Timer started), void valueGets(...), void distances(...)
+//	  void cacheHit(), void cacheMiss()
+//	  void visited(std::size_t children, std::size_t selected)
+//      once per visited node, in the order nodes were selected, children is Recorder::UnknownChildren for cache hits
+//	  void mergeReads(const Recorder& other)
+//      adds the gets recorded by a task reading the records of the traversal
+//	void add(const Recorder& recorder)
+//    called once per finished traversal, possibly concurrently
+//
+
+// nothing recorded, every call is empty and inlined away
+struct NoStatsPolicy {
+  class Recorder {
+  public:
+    struct Timer {};
+
+    static constexpr std::size_t UnknownChildren = static_cast<std::size_t>(-1);
+
+    Timer start() const { return Timer{}; }
+
+    void indexGets(std::size_t, Timer) {}
+    void valueGets(std::size_t, Timer) {}
+    void distances(std::size_t, Timer) {}
+
+    void cacheHit() {}
+    void cacheMiss() {}
+
+    void visited(std::size_t, std::size_t) {}
+    void mergeReads(const Recorder&) {}
+  };
+
+  void add(const Recorder&) {}
+};
+
+//
+// QueryStats of every query and their sum since the tree was opened or reset
+//
+class QueryStatsPolicy {
+public:
+  class Recorder {
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    QueryStats _stats;
+
+    // nodes of the level being visited not visited yet and nodes selected for the next level
+    // pending keys are FIFO, so a level ends exactly when its last selected node is visited
+    std::uint64_t _levelNodes = 1;
+    std::uint64_t _nextLevelNodes = 0;
+    std::size_t _depth = 0;
+
+  public:
+    using Timer = Clock::time_point;
+
+    static constexpr std::size_t UnknownChildren = static_cast<std::size_t>(-1);
+
+    Recorder() {
+      _stats.queries = 1;
+    }
+
+    const QueryStats& stats() const {
+      return _stats;
+    }
+
+    Timer start() const {
+      return Clock::now();
+    }
+
+    void indexGets(std::size_t count, Timer started) {
+      _stats.indexGets += count;
+      _stats.indexGetNanoseconds += elapsed(started);
+    }
+
+    void valueGets(std::size_t count, Timer started) {
+      _stats.valueGets += count;
+      _stats.valueGetNanoseconds += elapsed(started);
+    }
+
+    void distances(std::size_t count, Timer started) {
+      _stats.distances += count;
+      _stats.distanceNanoseconds += elapsed(started);
+    }
+
+    void cacheHit() {
+      ++_stats.cacheHits;
+    }
+
+    void cacheMiss() {
+      ++_stats.cacheMisses;
+    }
+
+    void visited(std::size_t children, std::size_t selected) {
+      ++_stats.nodesVisited;
+
+      if (UnknownChildren != children) {
+        if (_stats.levelChildren.size() <= _depth) {
+          _stats.levelChildren.resize(_depth + 1);
+          _stats.levelPruned.resize(_depth + 1);
+        }
+
+        _stats.levelChildren[_depth] += children;
+        _stats.levelPruned[_depth] += children - selected;
+      }
+
+      _nextLevelNodes += selected;
+      if (0 == --_levelNodes) {
+        _levelNodes = _nextLevelNodes;
+        _nextLevelNodes = 0;
+        ++_depth;
+      }
+    }
+
+    void mergeReads(const Recorder& other) {
+      _stats.indexGets += other._stats.indexGets;
+      _stats.indexGetNanoseconds += other._stats.indexGetNanoseconds;
+    }
+
+  private:
+    static std::uint64_t elapsed(Timer started) {
+      return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count());
+    }
+  };
+
+private:
+  mutable std::mutex _mutex;
+  QueryStats _total;
+
+public:
+  void add(const Recorder& recorder) {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _total += recorder.stats();
+  }
+
+  QueryStats total() const {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _total;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _total = QueryStats{};
+  }
+};
+
+#endif // STATS_POLICY_H
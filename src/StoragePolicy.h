@@ -0,0 +1,43 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef STORAGE_POLICY_H
+#define STORAGE_POLICY_H
+
+//
+// StoragePolicy is one ordered key-value store, a tree uses one for values and one for indexes
+//
+// require
+//	using Snapshot
+//    handle of a consistent read state, a default constructed Snapshot reads the latest state
+//	class WriteBatch
+//    void put(const std::string& key, const std::string& value)
+//    void remove(const std::string& key)
+//
+//	static std::shared_ptr<StoragePolicy> open(const std::string& path)
+//	bool get(const Snapshot& snapshot, const std::string& key, std::string& value)
+//    returns false if there is no such key
+//	void multiGet(const Snapshot& snapshot, const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found)
+//	void write(WriteBatch& batch)
+//    applies the whole batch atomically
+//	Snapshot snapshot()
+//	void release(const Snapshot& snapshot)
+//	void scan(const Snapshot& snapshot, const std::string& prefix, Callable callable)
+//    calls callable(key, value) for every key starting with prefix in ascending bytewise order
+//    callable must not call the storage
+//
+// optional
+//	struct Options
+//	static std::shared_ptr<StoragePolicy> open(const std::string& path, const Options& options)
+//    tuning per storage, values and indexes are read very differently
+//
+// every failure is thrown as std::runtime_error, read-only storages throw on write
+// all calls but write may run concurrently with each other and with one write
+//
+
+#endif // STORAGE_POLICY_H
@@ -0,0 +1,164 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+//
+// Executor requires
+//	void submit(std::function<void()> task)
+//
+// each worker owns a deque, tasks submitted from a worker go to its own deque and are popped LIFO
+// idle workers steal FIFO from the other deques, tasks from outside are spread round-robin
+//
+class WorkStealingPool {
+public:
+  using Task = std::function<void()>;
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::vector<std::thread> _threads;
+
+  std::mutex _idleMutex;
+  std::condition_variable _idle;
+  std::atomic<std::size_t> _queued;
+  std::atomic<std::size_t> _nextWorker;
+  bool _stopping;
+
+public:
+  explicit WorkStealingPool(std::size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+    : _queued{ 0 }
+    , _nextWorker{ 0 }
+    , _stopping{ false }
+  {
+    for (std::size_t i = 0; i != threads; ++i) {
+      _workers.emplace_back(new Worker);
+    }
+
+    for (std::size_t i = 0; i != threads; ++i) {
+      _threads.emplace_back([this, i]() { this->run(i); });
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator = (const WorkStealingPool&) = delete;
+
+  // queued tasks are drained before the workers exit
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock{_idleMutex};
+      _stopping = true;
+    }
+
+    _idle.notify_all();
+
+    for (auto& thread : _threads) {
+      thread.join();
+    }
+  }
+
+public:
+  std::size_t size() const {
+    return _workers.size();
+  }
+
+  void submit(Task task) {
+    auto& worker = *_workers[currentPool() == this ? currentIndex() : _nextWorker++ % _workers.size()];
+
+    {
+      // counted before the deque is unlocked, so pop() and steal() never take the task before it is counted
+      std::lock_guard<std::mutex> lock{worker.mutex};
+      worker.tasks.push_back(std::move(task));
+
+      std::lock_guard<std::mutex> idleLock{_idleMutex};
+      ++_queued;
+    }
+
+    _idle.notify_one();
+  }
+
+private:
+  static const WorkStealingPool*& currentPool() {
+    static thread_local const WorkStealingPool *pool = nullptr;
+    return pool;
+  }
+
+  static std::size_t& currentIndex() {
+    static thread_local std::size_t index = 0;
+    return index;
+  }
+
+  void run(std::size_t index) {
+    currentPool() = this;
+    currentIndex() = index;
+
+    while (true) {
+      Task task;
+
+      if (pop(index, task) || steal(index, task)) {
+        task();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock{_idleMutex};
+      _idle.wait(lock, [this]() { return _stopping || _queued > 0; });
+
+      if (_stopping && 0 == _queued)
+        return;
+    }
+  }
+
+  bool pop(std::size_t index, Task& task) {
+    auto& worker = *_workers[index];
+
+    std::lock_guard<std::mutex> lock{worker.mutex};
+    if (worker.tasks.empty())
+      return false;
+
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    --_queued;
+
+    return true;
+  }
+
+  bool steal(std::size_t index, Task& task) {
+    for (std::size_t i = 1; i != _workers.size(); ++i) {
+      auto& victim = *_workers[(index + i) % _workers.size()];
+
+      std::lock_guard<std::mutex> lock{victim.mutex};
+      if (victim.tasks.empty())
+        continue;
+
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      --_queued;
+
+      return true;
+    }
+
+    return false;
+  }
+};
+
+#endif // WORK_STEALING_POOL_H
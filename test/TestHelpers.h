@@ -0,0 +1,90 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef TEST_HELPERS_H
+#define TEST_HELPERS_H
+
+#include <exception>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <leveldb/db.h>
+
+//
+// fixtures shared by the test programs
+//
+
+class AssertionFailed : public std::exception {};
+
+// textbook two-column dynamic programming
+inline std::uint32_t referenceDistance(const std::string& s1, const std::string& s2) {
+  std::vector<std::uint32_t> col(s2.size() + 1);
+  std::vector<std::uint32_t> prevCol(s2.size() + 1);
+
+  for (std::size_t i = 0; i != prevCol.size(); ++i)
+    prevCol[i] = i;
+  for (std::size_t i = 0; i != s1.size(); ++i) {
+    col[0] = i + 1;
+    for (std::size_t j = 0; j != s2.size(); ++j)
+      col[j + 1] = std::min({ prevCol[1 + j] + 1, col[j] + 1, prevCol[j] + (s1[i] == s2[j] ? 0 : 1) });
+    col.swap(prevCol);
+  }
+
+  return prevCol[s2.size()];
+}
+
+inline std::string randomKey(std::mt19937& rng, std::size_t maxLength) {
+  std::string key(rng() % (maxLength + 1), '\0');
+  for (auto& c : key) {
+    c = static_cast<char>('a' + rng() % 4);
+  }
+
+  return key;
+}
+
+// "k" and up to maxLength random characters, repeated keys are drawn once
+inline std::map<std::string, std::string> randomKeyValues(std::mt19937& rng, std::size_t count, std::size_t maxLength) {
+  std::map<std::string, std::string> keyValues;
+  for (std::size_t i = 0; i != count; ++i) {
+    auto key = "k" + randomKey(rng, maxLength);
+    keyValues[key] = "v" + key;
+  }
+
+  return keyValues;
+}
+
+// calls check with `rounds` random keys shaped like the keys of randomKeyValues
+template<typename Callable>
+void forRandomKeys(std::mt19937& rng, int rounds, std::size_t maxLength, Callable&& check) {
+  for (int i = 0; i != rounds; ++i) {
+    check("k" + randomKey(rng, maxLength));
+  }
+}
+
+template<typename Expected, typename Tree>
+void expectSameQueries(std::mt19937& rng, Expected& expected, Tree& tree, std::size_t maxLength, int rounds = 100) {
+  forRandomKeys(rng, rounds, maxLength, [&](const std::string& key) {
+    if (tree.query(key, 2, 99999) != expected.query(key, 2, 99999))
+      throw AssertionFailed{};
+  });
+}
+
+template<typename Tree>
+std::unique_ptr<Tree> freshTree(const std::string& path) {
+  leveldb::DestroyDB(path, leveldb::Options());
+  leveldb::DestroyDB(path + "_i", leveldb::Options());
+
+  return std::unique_ptr<Tree>{ Tree::New(path, path + "_i") };
+}
+
+#endif // TEST_HELPERS_H
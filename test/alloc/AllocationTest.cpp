@@ -0,0 +1,79 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#include <thread>
+#include <map>
+#include <random>
+
+#include "LevenshteinDistance.h"
+#include "BKTree.h"
+#include "MappedBKTree.h"
+
+#include "TestSuite.h"
+#include "TestHelpers.h"
+#include "CountingNew.h"
+
+using TestSpec = LTest::SequentialTestSpec;
+using Container = LTest::SequentialTestRunnableContainer;
+
+//
+// tests counting the allocations of the whole program, see CountingNew.h
+//
+template<typename Spec>
+void cases(Spec& spec) {
+  spec.it("should not allocate querying a snapshot through a warm traversal", []() {
+    std::mt19937 rng{ 2037 };
+    std::map<std::string, std::string> keyValues;
+    for (int i = 0; i != 500; ++i) {
+      // keys over 64 characters take the blocked and banded distances
+      auto key = "k" + randomKey(rng, 8) + (i % 2 ? std::string(70 + rng() % 30, 'a') : std::string{});
+      keyValues[key] = "v" + key;
+    }
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_export_alloc");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+    MappedBKTreeWriter::write(*bktree, "/tmp/tmpdb_export_alloc.bkt");
+
+    std::unique_ptr<MappedBKTree<LevenshteinDistancePolicy>> mapped{ MappedBKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_export_alloc.bkt") };
+
+    const std::vector<std::string> keys{ "kabcd" + std::string(80, 'a'), "kbcda" + std::string(80, 'a'), "kabcd", "kdcba" };
+    MappedBKTree<LevenshteinDistancePolicy>::Traversal traversal;
+    std::size_t matches = 0;
+
+    auto queryAll = [&]() {
+      for (const auto& key : keys) {
+        mapped->query(key, 3, 3, traversal, [&](const MappedBKTree<LevenshteinDistancePolicy>::Match&) {
+          ++matches;
+          return true;
+        });
+      }
+    };
+
+    queryAll();
+
+    auto before = allocations.load();
+    queryAll();
+
+    if (allocations.load() != before || 0 == matches)
+      throw AssertionFailed{};
+  });
+
+}
+
+int main(void) {
+  auto container = std::make_unique<Container>();
+  auto spec = std::make_shared<TestSpec>();
+
+  cases(*spec);
+
+  container->scheduleToRun(spec);
+  container->start();
+  std::this_thread::sleep_for(1s);
+
+  return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#include <new>
+#include <cstdlib>
+
+#include "CountingNew.h"
+
+std::atomic<std::size_t> allocations{ 0 };
+
+void* operator new(std::size_t size) {
+  ++allocations;
+
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+
+  throw std::bad_alloc{};
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
@@ -0,0 +1,22 @@
+/*
+ * BKTree-LevelDB
+ *
+ * Copyright (c) 2016 "0of" Magnus
+ * Licensed under the MIT license.
+ * https://github.com/0of/bktree-leveldb/blob/master/LICENSE
+ */
+
+#ifndef COUNTING_NEW_H
+#define COUNTING_NEW_H
+
+#include <atomic>
+#include <cstddef>
+
+//
+// allocations made through the global operator new of this program
+//  the replacement lives in CountingNew.cpp and is linked into the allocation tests only,
+//  so the other tests keep the allocator of the standard library
+//
+extern std::atomic<std::size_t> allocations;
+
+#endif // COUNTING_NEW_H
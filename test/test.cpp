@@ -8,19 +8,28 @@
 
 #include <exception>
 #include <atomic>
+#include <thread>
 #include <unordered_map>
 #include <map>
+#include <random>
+#include <functional>
 
 #include "LevenshteinDistance.h"
+#include "HammingDistance.h"
 #include "BKTree.h"
+#include "ShardedBKTree.h"
+#include "LRUChildrenKeysCache.h"
+#include "IndexMigration.h"
+#include "MemoryStorage.h"
+#include "MappedStorage.h"
+#include "MappedBKTree.h"
 
 #include "TestSuite.h"
+#include "TestHelpers.h"
 
 using TestSpec = LTest::SequentialTestSpec;
 using Container = LTest::SequentialTestRunnableContainer;
 
-class AssertionFailed : public std::exception {};
-
 class CacheEntryContainer {
 private:
   std::map<std::uint32_t, std::string> &_entry;
@@ -69,6 +78,10 @@ public:
 
     _cache[key] = std::move(cacheEntry);
   }
+
+  void clear() {
+    _cache.clear();
+  }
 };
 
 struct ChildrenKeyPolicyImpl {
@@ -83,6 +96,38 @@ struct ChildrenKeyPolicyImpl {
   }
 };
 
+// place keys the way trees before node records did
+void insertLegacy(leveldb::DB* valuesDB, leveldb::DB* indexesDB, const std::string& key, const std::string& value) {
+  valuesDB->Put(leveldb::WriteOptions(), key, value);
+
+  std::string currentKey;
+  if (indexesDB->Get(leveldb::ReadOptions(), ROOT_INDEX_KEY, &currentKey).IsNotFound()) {
+    indexesDB->Put(leveldb::WriteOptions(), ROOT_INDEX_KEY, key);
+    indexesDB->Put(leveldb::WriteOptions(), CHILDREN_DISTANCES_KEY(key), leveldb::Slice{});
+    return;
+  }
+
+  std::string childKey;
+  for (auto d = LevenshteinDistancePolicy::distance(currentKey, key); 0 != d; d = LevenshteinDistancePolicy::distance(currentKey, key)) {
+    if (indexesDB->Get(leveldb::ReadOptions(), CHILD_INDEX_KEY(currentKey, d), &childKey).IsNotFound()) {
+      std::string distances;
+      indexesDB->Get(leveldb::ReadOptions(), CHILDREN_DISTANCES_KEY(currentKey), &distances);
+
+      std::size_t pos = 0;
+      while (pos != distances.size() && Helper::parse(distances.substr(pos, 4)) < d)
+        pos += 4;
+
+      indexesDB->Put(leveldb::WriteOptions(), CHILDREN_DISTANCES_KEY(currentKey), distances.insert(pos, Helper::stringfy(d)));
+      indexesDB->Put(leveldb::WriteOptions(), CHILD_INDEX_KEY(currentKey, d), key);
+      indexesDB->Put(leveldb::WriteOptions(), CHILDREN_DISTANCES_KEY(key), leveldb::Slice{});
+      indexesDB->Put(leveldb::WriteOptions(), CHILDREN_KEY(key), leveldb::Slice{});
+      return;
+    }
+
+    currentKey = childKey;
+  }
+}
+
 template<typename Spec>
 void cases(Spec& spec) {
   spec.it("should query key1 & key2", []() {
@@ -95,6 +140,920 @@ void cases(Spec& spec) {
     if (q.find("value1") == q.end() || q.find("value2") == q.end())
       throw AssertionFailed{};
   });
+
+  spec.it("should compute the same levenshtein distance as dynamic programming", []() {
+    std::mt19937 rng{ 2016 };
+
+    for (int i = 0; i != 20000; ++i) {
+      // exceed one 64-bit word to cover the blocked kernel
+      auto s1 = randomKey(rng, i % 2 ? 40 : 200);
+      auto s2 = randomKey(rng, i % 2 ? 40 : 200);
+      auto expected = referenceDistance(s1, s2);
+
+      if (LevenshteinDistancePolicy::distance(s1, s2) != expected ||
+          LevenshteinDistancePolicy::distance(LevenshteinDistancePolicy::prepare(s2), s1) != expected)
+        throw AssertionFailed{};
+    }
+  });
+
+  spec.it("should stop bounded levenshtein distance beyond the cutoff", []() {
+    std::mt19937 rng{ 2017 };
+
+    for (int i = 0; i != 20000; ++i) {
+      auto s1 = randomKey(rng, i % 2 ? 40 : 200);
+      auto s2 = randomKey(rng, i % 2 ? 40 : 200);
+      auto maxDistance = static_cast<std::uint32_t>(rng() % 16);
+      auto expected = std::min(referenceDistance(s1, s2), maxDistance + 1);
+
+      if (LevenshteinDistancePolicy::distance(s1, s2, maxDistance) != expected ||
+          LevenshteinDistancePolicy::distance(LevenshteinDistancePolicy::prepare(s2), s1, maxDistance) != expected)
+        throw AssertionFailed{};
+    }
+  });
+
+  spec.it("should compute the same levenshtein distances in batch as one by one", []() {
+    std::mt19937 rng{ 2018 };
+
+    for (int i = 0; i != 2000; ++i) {
+      auto queryKey = randomKey(rng, 64);
+      auto pattern = LevenshteinDistancePolicy::prepare(queryKey);
+
+      std::vector<std::string> keys(rng() % 20);
+      for (auto& key : keys) {
+        key = randomKey(rng, 80);
+      }
+
+      std::vector<std::uint32_t> distances;
+      LevenshteinDistancePolicy::distance(pattern, keys, std::vector<std::uint32_t>(keys.size(), 999), distances);
+
+      for (std::size_t k = 0; k != keys.size(); ++k) {
+        if (distances[k] != referenceDistance(keys[k], queryKey))
+          throw AssertionFailed{};
+      }
+    }
+  });
+
+  spec.it("should compute the same levenshtein distances with every batch kernel the cpu supports", []() {
+    using Policy = LevenshteinDistancePolicy;
+    std::mt19937 rng{ 2038 };
+
+    auto check = [&rng](auto kernel) {
+      for (int i = 0; i != 500; ++i) {
+        auto queryKey = "k" + randomKey(rng, 63);
+        auto pattern = Policy::prepare(queryKey);
+
+        // lane counts off the SIMD widths, half of the keys longer than the pattern
+        std::vector<std::string> keys(rng() % 19);
+        for (auto& key : keys) {
+          key = randomKey(rng, 40) + (rng() % 2 ? queryKey + randomKey(rng, 40) : std::string{});
+        }
+
+        std::vector<std::uint32_t> expected(keys.size());
+        std::vector<std::uint32_t> distances(keys.size());
+        Policy::batchScalar(pattern.masks(0), pattern.size(), keys.data(), keys.size(), expected.data());
+        kernel(pattern.masks(0), pattern.size(), keys.data(), keys.size(), distances.data());
+
+        for (std::size_t k = 0; k != keys.size(); ++k) {
+          if (distances[k] != expected[k] || expected[k] != referenceDistance(keys[k], queryKey))
+            throw AssertionFailed{};
+        }
+      }
+    };
+
+    check(&Policy::batchScalar);
+#ifdef LEVENSHTEIN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+      check(&Policy::batchSSE42);
+    if (__builtin_cpu_supports("avx2"))
+      check(&Policy::batchAVX2);
+    if (__builtin_cpu_supports("avx512f"))
+      check(&Policy::batchAVX512);
+#endif
+  });
+
+  spec.it("should compute the same hamming distances as counting bits", []() {
+    std::mt19937_64 rng{ 2031 };
+
+    auto check = [&rng](auto policy) {
+      using Policy = decltype(policy);
+
+      auto randomHash = [&rng]() {
+        typename Policy::Words64 words;
+        for (auto& word : words) {
+          word = rng() & rng();
+        }
+
+        return Policy::key(words);
+      };
+
+      auto bitCount = [](const std::string& s1, const std::string& s2) {
+        std::uint32_t count = 0;
+        for (std::size_t i = 0; i != s1.size(); ++i) {
+          for (unsigned char x = s1[i] ^ s2[i]; x; x &= x - 1) {
+            ++count;
+          }
+        }
+
+        return count;
+      };
+
+      auto queryKey = randomHash();
+      auto pattern = Policy::prepare(queryKey);
+
+      std::vector<std::string> keys(50);
+      for (auto& key : keys) {
+        key = randomHash();
+      }
+
+      std::vector<std::uint32_t> distances;
+      Policy::distance(pattern, keys, std::vector<std::uint32_t>(keys.size(), 0), distances);
+
+      for (std::size_t k = 0; k != keys.size(); ++k) {
+        auto expected = bitCount(keys[k], queryKey);
+        if (distances[k] != expected || Policy::distance(keys[k], queryKey) != expected || Policy::distance(pattern, keys[k]) != expected)
+          throw AssertionFailed{};
+      }
+
+      bool refused = false;
+      try {
+        Policy::distance(queryKey, queryKey.substr(1));
+      } catch (const std::invalid_argument&) {
+        refused = true;
+      }
+
+      if (!refused)
+        throw AssertionFailed{};
+    };
+
+    for (int i = 0; i != 100; ++i) {
+      check(HammingDistancePolicy<64>{});
+      check(HammingDistancePolicy<192>{});
+      check(HammingDistancePolicy<256>{});
+      check(HammingDistancePolicy<512>{});
+    }
+  });
+
+  spec.it("should count the same hamming distances with every kernel the cpu supports", []() {
+    std::mt19937_64 rng{ 2039 };
+
+    auto check = [&rng](auto policy) {
+      using Policy = decltype(policy);
+
+      auto compare = [&rng](auto count) {
+        for (int i = 0; i != 200; ++i) {
+          typename Policy::Words64 words1;
+          typename Policy::Words64 words2;
+          for (std::size_t w = 0; w != Policy::Words; ++w) {
+            words1[w] = rng();
+            words2[w] = rng() & rng();
+          }
+
+          auto s1 = Policy::key(words1);
+          auto s2 = Policy::key(words2);
+          if (count(s1.data(), s2.data()) != Policy::countScalar(s1.data(), s2.data()))
+            throw AssertionFailed{};
+        }
+      };
+
+#ifdef HAMMING_X86_KERNELS
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("popcnt"))
+        compare(&Policy::countPOPCNT);
+      if (0 == Policy::Words % 4 && __builtin_cpu_supports("avx2"))
+        compare(&Policy::countAVX2);
+      if (0 == Policy::Words % 8 && __builtin_cpu_supports("avx512vpopcntdq"))
+        compare(&Policy::countAVX512);
+#endif
+    };
+
+    check(HammingDistancePolicy<64>{});
+    check(HammingDistancePolicy<192>{});
+    check(HammingDistancePolicy<256>{});
+    check(HammingDistancePolicy<512>{});
+  });
+
+  spec.it("should query the same hashes by hamming distance as a linear scan", []() {
+    using Policy = HammingDistancePolicy<64>;
+    std::mt19937_64 rng{ 2032 };
+
+    std::map<std::string, std::string> keyValues;
+    for (int i = 0; i != 2000; ++i) {
+      auto key = Policy::key({ rng() });
+      keyValues[key] = std::to_string(i);
+    }
+
+    auto bktree = freshTree<BKTree<Policy>>("/tmp/tmpdb_hamming");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+
+    for (int i = 0; i != 50; ++i) {
+      // near duplicates of stored hashes
+      auto stored = std::next(keyValues.begin(), rng() % keyValues.size())->first;
+      std::uint64_t hash;
+      std::memcpy(&hash, stored.data(), sizeof(hash));
+      auto key = Policy::key({ hash ^ (std::uint64_t{1} << (rng() % 64)) ^ (std::uint64_t{1} << (rng() % 64)) });
+
+      std::set<std::string> expected;
+      for (const auto& keyValue : keyValues) {
+        if (Policy::distance(keyValue.first, key) < 20)
+          expected.insert(keyValue.second);
+      }
+
+      if (bktree->query(key, 20, 99999) != expected || expected.empty())
+        throw AssertionFailed{};
+    }
+  });
+
+  spec.it("should query the same values with fixed-width keys as with variable ones", []() {
+    using Policy = HammingDistancePolicy<64>;
+    using FixedTree = BKTree<Policy, ChildrenKeysCacheImpl, ChildrenKeyPolicyImpl, LevelDBStorage, FixedKeyTraits<8>>;
+    std::mt19937_64 rng{ 2033 };
+
+    std::map<std::string, std::string> keyValues;
+    for (int i = 0; i != 2000; ++i) {
+      auto key = Policy::key({ rng() & 0xffff0000ffffULL });
+      keyValues[key] = std::to_string(i);
+    }
+
+    auto variable = freshTree<BKTree<Policy>>("/tmp/tmpdb_variable");
+    variable->bulkLoad(keyValues.begin(), keyValues.end());
+
+    auto fixed = freshTree<FixedTree>("/tmp/tmpdb_fixed");
+    fixed->bulkLoad(keyValues.begin(), keyValues.end());
+    fixed.reset();
+
+    std::unique_ptr<FixedTree> pinned{ FixedTree::New("/tmp/tmpdb_fixed", "/tmp/tmpdb_fixed_i", PinOptions{2}) };
+
+    WorkStealingPool pool{ 2 };
+    for (int i = 0; i != 50; ++i) {
+      auto key = Policy::key({ rng() & 0xffff0000ffffULL });
+      auto expected = variable->query(key, 12, 99999);
+
+      if (pinned->query(key, 12, 99999) != expected || pinned->queryPrefetched(key, 12, 99999, pool) != expected)
+        throw AssertionFailed{};
+
+      std::size_t streamed = 0;
+      for (const auto& match : pinned->queryStream(key, 12)) {
+        if (!expected.count(match.value()))
+          throw AssertionFailed{};
+        ++streamed;
+      }
+
+      if (streamed != expected.size())
+        throw AssertionFailed{};
+    }
+
+    // keys of any other width are rejected
+    try {
+      pinned->insert("short", "value");
+      throw AssertionFailed{};
+    } catch (const std::invalid_argument&) {}
+  });
+
+  spec.it("should record the reads, distances and pruning of queries", []() {
+    using StatsTree = BKTree<LevenshteinDistancePolicy, NoCachePolicy, DisableChildrenKey, LevelDBStorage, VariableKeyTraits, QueryStatsPolicy>;
+    std::mt19937 rng{ 2034 };
+
+    auto keyValues = randomKeyValues(rng, 1000, 10);
+
+    auto bktree = freshTree<StatsTree>("/tmp/tmpdb_stats");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+
+    QueryStats stats;
+    auto values = bktree->query("kabcdabcd", 1, 99999, 1, stats);
+
+    // every node visited is read and measured once, each visited node but the root was a selected child
+    std::uint64_t children = 0;
+    std::uint64_t pruned = 0;
+    for (std::size_t depth = 0; depth != stats.levelChildren.size(); ++depth) {
+      children += stats.levelChildren[depth];
+      pruned += stats.levelPruned[depth];
+    }
+
+    if (1 != stats.queries || 0 == stats.nodesVisited || stats.indexGets != stats.nodesVisited || stats.distances != stats.nodesVisited || stats.valueGets != values.size())
+      throw AssertionFailed{};
+
+    if (children - pruned != stats.nodesVisited - 1 || 0 == pruned || 0 != stats.cacheHits + stats.cacheMisses)
+      throw AssertionFailed{};
+
+    {
+      auto streamed = bktree->queryStream("kabcdabcd", 1);
+      for (const auto& match : streamed) {
+        match.value();
+      }
+
+      if (streamed.stats().nodesVisited != stats.nodesVisited || streamed.stats().valueGets != values.size())
+        throw AssertionFailed{};
+    }
+
+    // the stream is recorded once destroyed
+    auto total = bktree->stats().total();
+    if (2 != total.queries || total.nodesVisited != 2 * stats.nodesVisited || total.levelChildren[0] != 2 * stats.levelChildren[0])
+      throw AssertionFailed{};
+
+    // nodes served by the cache are visited without their children counted
+    bktree.reset();
+    using CachedStatsTree = BKTree<LevenshteinDistancePolicy, LRUChildrenKeysCache, DisableChildrenKey, LevelDBStorage, VariableKeyTraits, QueryStatsPolicy>;
+    std::unique_ptr<CachedStatsTree> cached{ CachedStatsTree::New("/tmp/tmpdb_stats", "/tmp/tmpdb_stats_i") };
+
+    QueryStats missed;
+    QueryStats hit;
+    cached->query("kabcdabcd", 1, 99999, 1, missed);
+    cached->query("kabcdabcd", 1, 99999, 1, hit);
+
+    if (missed.cacheMisses != missed.nodesVisited || hit.cacheHits != hit.nodesVisited || hit.nodesVisited != stats.nodesVisited || 0 != hit.indexGets || !hit.levelChildren.empty())
+      throw AssertionFailed{};
+
+    // every node is counted once, every node but the root is a child
+    auto shape = cached->scanShape().get();
+    std::uint64_t depths = 0;
+    std::uint64_t fanouts = 0;
+    for (auto nodes : shape.depths) {
+      depths += nodes;
+    }
+    for (const auto& fanout : shape.fanouts) {
+      fanouts += fanout.first * fanout.second;
+    }
+
+    if (shape.nodes != keyValues.size() || depths != shape.nodes || fanouts != shape.nodes - 1 || 1 != shape.depths[0])
+      throw AssertionFailed{};
+  });
+
+  spec.it("should query the same values from shards as from one tree", []() {
+    using Sharded = ShardedBKTree<LevenshteinDistancePolicy>;
+    std::mt19937 rng{ 2035 };
+
+    auto keyValues = randomKeyValues(rng, 2000, 8);
+
+    std::vector<std::string> paths;
+    for (int i = 0; i != 3; ++i) {
+      paths.push_back("/tmp/tmpdb_sharded" + std::to_string(i));
+      leveldb::DestroyDB(paths.back(), leveldb::Options());
+      leveldb::DestroyDB(paths.back() + "_i", leveldb::Options());
+    }
+
+    auto single = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_unsharded");
+    single->bulkLoad(keyValues.begin(), keyValues.end());
+
+    std::unique_ptr<Sharded> sharded{ Sharded::New(paths) };
+    // chunks smaller than the range are loaded one after another
+    sharded->bulkLoad(keyValues.begin(), std::next(keyValues.begin(), 1000), 128);
+    for (auto it = std::next(keyValues.begin(), 1000); it != keyValues.end(); ++it) {
+      sharded->insert(it->first, it->second);
+    }
+
+    single->erase(std::next(keyValues.begin(), 7)->first);
+    sharded->erase(std::next(keyValues.begin(), 7)->first);
+
+    forRandomKeys(rng, 50, 8, [&](const std::string& key) {
+      auto expected = single->query(key, 2, 99999);
+
+      if (sharded->query(key, 2, 99999) != expected || sharded->nearest(key, 5) != single->nearest(key, 5))
+        throw AssertionFailed{};
+
+      auto limited = sharded->query(key, 3, 2);
+      auto all = single->query(key, 3, 99999);
+      if (limited.size() != std::min<std::size_t>(2, all.size()) || !std::includes(all.begin(), all.end(), limited.begin(), limited.end()))
+        throw AssertionFailed{};
+    });
+
+    // keys are spread over every shard, shards are only opened at their place
+    for (std::size_t i = 0; i != sharded->size(); ++i) {
+      if (sharded->shard(i).query("k", 99, 1).empty())
+        throw AssertionFailed{};
+    }
+
+    sharded.reset();
+    try {
+      std::unique_ptr<Sharded> reordered{ Sharded::New(std::vector<std::string>{ paths[1], paths[0], paths[2] }) };
+      throw AssertionFailed{};
+    } catch (const std::runtime_error&) {}
+  });
+
+  spec.it("should query the same values from an exported snapshot", []() {
+    std::mt19937 rng{ 2036 };
+    auto keyValues = randomKeyValues(rng, 2000, 8);
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_export");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+    bktree->erase(keyValues.begin()->first);
+    MappedBKTreeWriter::write(*bktree, "/tmp/tmpdb_export.bkt");
+
+    std::unique_ptr<MappedBKTree<LevenshteinDistancePolicy>> mapped{ MappedBKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_export.bkt") };
+    if (mapped->size() != keyValues.size())
+      throw AssertionFailed{};
+
+    MappedBKTree<LevenshteinDistancePolicy>::Traversal traversal;
+    forRandomKeys(rng, 100, 8, [&](const std::string& key) {
+      auto expected = bktree->query(key, 2, 99999);
+
+      // nodes are visited in the same order, so limited queries keep the same values too
+      if (mapped->query(key, 2, 99999) != expected || mapped->query(key, 3, 3) != bktree->query(key, 3, 3))
+        throw AssertionFailed{};
+
+      std::set<std::string> matched;
+      mapped->query(key, 2, 2, traversal, [&](const MappedBKTree<LevenshteinDistancePolicy>::Match& match) {
+        if (match.distance != referenceDistance(std::string(match.key, match.keySize), key))
+          throw AssertionFailed{};
+
+        matched.emplace(match.value, match.valueSize);
+        return true;
+      });
+
+      if (matched != expected)
+        throw AssertionFailed{};
+    });
+
+    // empty trees export an empty snapshot
+    auto empty = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_export_empty");
+    MappedBKTreeWriter::write(*empty, "/tmp/tmpdb_export_empty.bkt");
+
+    std::unique_ptr<MappedBKTree<LevenshteinDistancePolicy>> mappedEmpty{ MappedBKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_export_empty.bkt") };
+    if (0 != mappedEmpty->size() || !mappedEmpty->query("key", 3, 99999).empty())
+      throw AssertionFailed{};
+  });
+
+  spec.it("should query the same values after bulk load as after insert", []() {
+    std::vector<std::pair<std::string, std::string>> keyValues{
+      {"book", "v1"}, {"books", "v2"}, {"cake", "v3"}, {"boo", "v4"}, {"cape", "v5"}, {"cart", "v6"}, {"boon", "v7"}, {"cook", "v8"}
+    };
+
+    auto inserted = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_inserted");
+    for (const auto& keyValue : keyValues) {
+      inserted->insert(keyValue.first, keyValue.second);
+    }
+
+    auto loaded = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_loaded");
+    loaded->bulkLoad(keyValues.begin(), keyValues.end(), 3);
+
+    for (const auto& keyValue : keyValues) {
+      if (inserted->query(keyValue.first, 1, 999) != loaded->query(keyValue.first, 1, 999))
+        throw AssertionFailed{};
+    }
+  });
+
+  spec.it("should query the same values in parallel as sequentially", []() {
+    std::mt19937 rng{ 2019 };
+    auto keyValues = randomKeyValues(rng, 2000, 4);
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy, ChildrenKeysCacheImpl, ChildrenKeyPolicyImpl>>("/tmp/tmpdb_parallel");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+
+    WorkStealingPool pool{4};
+    forRandomKeys(rng, 50, 6, [&](const std::string& key) {
+      if (bktree->queryParallel(key, 2, 99999, pool) != bktree->query(key, 2, 99999))
+        throw AssertionFailed{};
+
+      if (bktree->queryParallel(key, 2, 3, pool).size() != std::min<std::size_t>(3, bktree->query(key, 2, 99999).size()))
+        throw AssertionFailed{};
+    });
+  });
+
+  spec.it("should query while another thread is inserting", []() {
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_concurrent");
+    bktree->insert("key", "value");
+
+    std::atomic<int> inserted{ 0 };
+    std::atomic<bool> failed{ false };
+
+    std::thread writer{[&]() {
+      for (int i = 0; i != 300; ++i) {
+        bktree->insert("key" + std::to_string(i), std::to_string(i));
+        ++inserted;
+      }
+    }};
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r != 3; ++r) {
+      readers.emplace_back([&]() {
+        while (inserted != 300) {
+          int insertedBefore = inserted;
+          auto q = bktree->query("key", 999, 99999, 999);
+
+          // every key inserted before the query started is visible
+          for (int i = 0; i != insertedBefore; ++i) {
+            if (q.find(std::to_string(i)) == q.end())
+              failed = true;
+          }
+        }
+      });
+    }
+
+    writer.join();
+    for (auto& reader : readers) {
+      reader.join();
+    }
+
+    if (failed)
+      throw AssertionFailed{};
+  });
+
+  spec.it("should query through a bounded LRU children keys cache", []() {
+    std::mt19937 rng{ 2020 };
+    auto keyValues = randomKeyValues(rng, 2000, 10);
+
+    auto uncached = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_uncached");
+    uncached->bulkLoad(keyValues.begin(), keyValues.end());
+
+    auto cached = freshTree<BKTree<LevenshteinDistancePolicy, LRUChildrenKeysCache>>("/tmp/tmpdb_lru");
+    cached->cache() = LRUChildrenKeysCache{4096, 4};
+    cached->bulkLoad(keyValues.begin(), keyValues.end());
+
+    expectSameQueries(rng, *uncached, *cached, 10);
+
+    // new children are visible through cached parents
+    cached->insert("abcdabcdabcd", "inserted");
+    if (cached->query("abcdabcdabcd", 0, 99999, 1) != std::set<std::string>{ "inserted" })
+      throw AssertionFailed{};
+
+    auto stats = cached->cache().stats();
+    if (0 == stats.hits || 0 == stats.misses || 0 == stats.evictions || stats.bytes > 4096)
+      throw AssertionFailed{};
+  });
+
+  spec.it("should not fill the cache of a tree from an older clone", []() {
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy, LRUChildrenKeysCache>>("/tmp/tmpdb_lru_clone");
+    bktree->insert("book", "vbook");
+
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy, LRUChildrenKeysCache>> clone{ bktree->clone(true) };
+    bktree->insert("books", "vbooks");
+
+    // the clone still reads the tree before "books" and caches what it read
+    if (clone->query("book", 2, 99) != std::set<std::string>{ "vbook" })
+      throw AssertionFailed{};
+
+    if (bktree->query("book", 2, 99) != std::set<std::string>{ "vbook", "vbooks" })
+      throw AssertionFailed{};
+  });
+
+  spec.it("should query the same values through pinned top levels", []() {
+    std::mt19937 rng{ 2021 };
+    auto keyValues = randomKeyValues(rng, 2000, 10);
+
+    auto unpinned = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_unpinned");
+    unpinned->bulkLoad(keyValues.begin(), std::next(keyValues.begin(), 1000));
+
+    auto loaded = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_pinned");
+    loaded->bulkLoad(keyValues.begin(), std::next(keyValues.begin(), 1000));
+    loaded.reset();
+
+    // pinned while opening, then kept current by the inserts
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy>> pinned{ BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_pinned", "/tmp/tmpdb_pinned_i", PinOptions{3, 200}) };
+    for (auto it = std::next(keyValues.begin(), 1000); it != keyValues.end(); ++it) {
+      unpinned->insert(it->first, it->second);
+      pinned->insert(it->first, it->second);
+    }
+
+    expectSameQueries(rng, *unpinned, *pinned, 10);
+  });
+
+  spec.it("should skip erased keys and reclaim them by compaction", []() {
+    std::mt19937 rng{ 2022 };
+    auto keyValues = randomKeyValues(rng, 1000, 8);
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_erase");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+
+    // erase the root and every third key
+    std::set<std::string> live;
+    std::size_t erased = 0;
+    for (const auto& keyValue : keyValues) {
+      if (0 == erased || 0 == keyValue.first.size() % 3) {
+        if (!bktree->erase(keyValue.first) || bktree->erase(keyValue.first))
+          throw AssertionFailed{};
+        ++erased;
+      } else {
+        live.insert(keyValue.second);
+      }
+    }
+
+    if (bktree->erase("not stored") || bktree->query("", 999, 99999, 999) != live)
+      throw AssertionFailed{};
+
+    // tombstones survive reopening
+    bktree.reset();
+    bktree.reset(BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_erase", "/tmp/tmpdb_erase_i", PinOptions{2}));
+    if (bktree->query("", 999, 99999, 999) != live)
+      throw AssertionFailed{};
+
+    if (bktree->compact() != erased || bktree->compact() != 0 || bktree->query("", 999, 99999, 999) != live)
+      throw AssertionFailed{};
+
+    // erased keys can be inserted again
+    const auto& revived = *keyValues.begin();
+    bktree->insert(revived.first, revived.second);
+    live.insert(revived.second);
+    if (bktree->query("", 999, 99999, 999) != live)
+      throw AssertionFailed{};
+  });
+
+  spec.it("should clear caches without invalidate when compaction removes nodes", []() {
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy, ChildrenKeysCacheImpl, ChildrenKeyPolicyImpl>>("/tmp/tmpdb_compact_cache");
+    for (const auto& key : { "book", "boon", "cake", "boot", "cape", "cart", "coop", "cook" }) {
+      bktree->insert(key, std::string{"v"} + key);
+    }
+
+    // fill the cache with every node
+    bktree->query("book", 99, 99999);
+
+    for (const auto& key : { "book", "cake", "boot" }) {
+      bktree->erase(key);
+    }
+
+    if (3 != bktree->compact())
+      throw AssertionFailed{};
+
+    if (bktree->query("book", 99, 99999) != std::set<std::string>{ "vboon", "vcape", "vcart", "vcoop", "vcook" })
+      throw AssertionFailed{};
+  });
+
+  spec.it("should query the same values after migrating legacy indexes", []() {
+    std::mt19937 rng{ 2023 };
+    auto keyValues = randomKeyValues(rng, 1000, 10);
+
+    auto expected = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_records");
+    expected->bulkLoad(keyValues.begin(), keyValues.end());
+
+    leveldb::DestroyDB("/tmp/tmpdb_legacy", leveldb::Options());
+    leveldb::DestroyDB("/tmp/tmpdb_legacy_i", leveldb::Options());
+    {
+      leveldb::Options options;
+      options.create_if_missing = true;
+
+      leveldb::DB* valuesDB = nullptr;
+      leveldb::DB* indexesDB = nullptr;
+      leveldb::DB::Open(options, "/tmp/tmpdb_legacy", &valuesDB);
+      leveldb::DB::Open(options, "/tmp/tmpdb_legacy_i", &indexesDB);
+
+      std::unique_ptr<leveldb::DB> values{ valuesDB };
+      std::unique_ptr<leveldb::DB> indexes{ indexesDB };
+      for (const auto& keyValue : keyValues) {
+        insertLegacy(valuesDB, indexesDB, keyValue.first, keyValue.second);
+      }
+    }
+
+    // legacy indexes are refused until migrated
+    bool refused = false;
+    try {
+      delete BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_legacy", "/tmp/tmpdb_legacy_i");
+    } catch (const std::runtime_error&) {
+      refused = true;
+    }
+
+    if (!refused || IndexMigration::migrate("/tmp/tmpdb_legacy_i", 64) != keyValues.size() || IndexMigration::migrate("/tmp/tmpdb_legacy_i") != 0)
+      throw AssertionFailed{};
+
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy>> migrated{ BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_legacy", "/tmp/tmpdb_legacy_i") };
+    expectSameQueries(rng, *expected, *migrated, 10);
+  });
+
+  spec.it("should query the same values from memory and mapped storages", []() {
+    using MemoryTree = BKTree<LevenshteinDistancePolicy, NoCachePolicy, DisableChildrenKey, MemoryStorage>;
+    using MappedTree = BKTree<LevenshteinDistancePolicy, NoCachePolicy, DisableChildrenKey, MappedStorage>;
+
+    std::mt19937 rng{ 2024 };
+    auto keyValues = randomKeyValues(rng, 1000, 10);
+
+    auto expected = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_storage");
+    expected->bulkLoad(keyValues.begin(), keyValues.end());
+    expected->erase(keyValues.rbegin()->first);
+
+    auto values = std::make_shared<MemoryStorage>();
+    auto indexes = std::make_shared<MemoryStorage>();
+    std::unique_ptr<MemoryTree> memory{ MemoryTree::New(values, indexes) };
+    memory->bulkLoad(keyValues.begin(), keyValues.end());
+    memory->erase(keyValues.rbegin()->first);
+
+    MappedStorage::build("/tmp/tmpdb_mapped", *values);
+    MappedStorage::build("/tmp/tmpdb_mapped_i", *indexes);
+    std::unique_ptr<MappedTree> mapped{ MappedTree::New("/tmp/tmpdb_mapped", "/tmp/tmpdb_mapped_i") };
+
+    expectSameQueries(rng, *expected, *memory, 10);
+    expectSameQueries(rng, *expected, *mapped, 10);
+
+    // mapped storages are read-only
+    bool refused = false;
+    try {
+      mapped->insert("kkey", "value");
+    } catch (const std::runtime_error&) {
+      refused = true;
+    }
+
+    if (!refused)
+      throw AssertionFailed{};
+  });
+
+  spec.it("should query the same values with tuned storage options", []() {
+    std::mt19937 rng{ 2025 };
+    auto keyValues = randomKeyValues(rng, 1000, 10);
+
+    auto expected = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_default_options");
+    expected->bulkLoad(keyValues.begin(), keyValues.end());
+
+    leveldb::DestroyDB("/tmp/tmpdb_tuned_options", leveldb::Options());
+    leveldb::DestroyDB("/tmp/tmpdb_tuned_options_i", leveldb::Options());
+
+    auto cache = LevelDBStorage::Options::sharedCache(1 << 20);
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy>> tuned{ BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_tuned_options", "/tmp/tmpdb_tuned_options_i",
+                                                                                                     LevelDBStorage::Options::values(cache), LevelDBStorage::Options::indexes(cache)) };
+    tuned->bulkLoad(keyValues.begin(), keyValues.end());
+
+    expectSameQueries(rng, *expected, *tuned, 10);
+  });
+
+  spec.it("should query the same values with values and indexes in one storage", []() {
+    std::mt19937 rng{ 2026 };
+    auto keyValues = randomKeyValues(rng, 1000, 10);
+
+    auto expected = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_split");
+    expected->bulkLoad(keyValues.begin(), keyValues.end());
+    expected->erase(keyValues.begin()->first);
+    expected->compact();
+
+    leveldb::DestroyDB("/tmp/tmpdb_single", leveldb::Options());
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy>> single{ BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_single") };
+    single->bulkLoad(keyValues.begin(), keyValues.end());
+    single->erase(keyValues.begin()->first);
+    single->compact();
+
+    // reopened in the same layout only
+    single.reset();
+    bool refused = false;
+    try {
+      delete BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_single_values", "/tmp/tmpdb_single");
+    } catch (const std::runtime_error&) {
+      refused = true;
+    }
+
+    single.reset(BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_single", PinOptions{2}));
+    if (!refused)
+      throw AssertionFailed{};
+
+    expectSameQueries(rng, *expected, *single, 10);
+  });
+
+  spec.it("should find the same nearest keys as a linear scan", []() {
+    std::mt19937 rng{ 2027 };
+    auto keyValues = randomKeyValues(rng, 1000, 10);
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_nearest");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+    bktree->erase(keyValues.begin()->first);
+    keyValues.erase(keyValues.begin());
+
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy>> pinned{ BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_nearest", "/tmp/tmpdb_nearest_i", PinOptions{2}) };
+
+    forRandomKeys(rng, 50, 10, [&](const std::string& key) {
+      std::vector<BKTree<LevenshteinDistancePolicy>::Neighbour> expected;
+      for (const auto& keyValue : keyValues) {
+        expected.emplace_back(keyValue.first, referenceDistance(keyValue.first, key), keyValue.second);
+      }
+
+      std::sort(expected.begin(), expected.end(), [](const BKTree<LevenshteinDistancePolicy>::Neighbour& left, const BKTree<LevenshteinDistancePolicy>::Neighbour& right) {
+        return std::tie(std::get<1>(left), std::get<0>(left)) < std::tie(std::get<1>(right), std::get<0>(right));
+      });
+      expected.resize(5);
+
+      if (bktree->nearest(key, 5) != expected || pinned->nearest(key, 5) != expected)
+        throw AssertionFailed{};
+
+      // at most the keys within the distance
+      auto within = bktree->nearest(key, 5, 1);
+      if (within.size() > 5 || !std::equal(within.begin(), within.end(), expected.begin()) || (within.size() < 5 && std::get<1>(expected[within.size()]) <= 1))
+        throw AssertionFailed{};
+    });
+  });
+
+  spec.it("should stream the same matches as a query", []() {
+    std::mt19937 rng{ 2028 };
+    auto keyValues = randomKeyValues(rng, 1000, 8);
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_stream");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+    bktree->erase(keyValues.begin()->first);
+
+    forRandomKeys(rng, 50, 8, [&](const std::string& key) {
+      std::set<std::string> keys;
+      std::set<std::string> values;
+
+      // values read for some matches only
+      bool skip = false;
+      for (const auto& match : bktree->queryStream(key, 3)) {
+        if (match.distance() != referenceDistance(match.key(), key) || match.distance() > 3 || !keys.insert(match.key()).second)
+          throw AssertionFailed{};
+
+        if (!(skip = !skip))
+          values.insert(match.value());
+      }
+
+      auto expected = bktree->query(key, 3, 99999);
+      if (expected.size() != keys.size())
+        throw AssertionFailed{};
+
+      for (const auto& value : values) {
+        if (!expected.count(value))
+          throw AssertionFailed{};
+      }
+    });
+
+    // streams of an empty tree yield nothing
+    auto empty = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_stream_empty");
+    auto stream = empty->queryStream("key", 3);
+    if (stream.begin() != stream.end())
+      throw AssertionFailed{};
+  });
+
+  spec.it("should query the same values in one batch as one by one", []() {
+    std::mt19937 rng{ 2029 };
+    auto keyValues = randomKeyValues(rng, 2000, 8);
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_shared");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+    bktree->erase(keyValues.begin()->first);
+
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy, ChildrenKeysCacheImpl, ChildrenKeyPolicyImpl>> cached{ BKTree<LevenshteinDistancePolicy, ChildrenKeysCacheImpl, ChildrenKeyPolicyImpl>::New("/tmp/tmpdb_shared", "/tmp/tmpdb_shared_i", PinOptions{2}) };
+
+    // repeated keys and keys of the tree included
+    std::vector<std::string> keys;
+    for (int i = 0; i != 300; ++i) {
+      keys.push_back(i % 3 ? "k" + randomKey(rng, 8) : std::next(keyValues.begin(), i)->first);
+    }
+    keys.push_back(keys.front());
+
+    auto batch = bktree->queryBatch(keys, 2);
+    auto cachedBatch = cached->queryBatch(keys, 2);
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      auto expected = bktree->query(keys[i], 2, 99999);
+      if (batch[i] != expected || cachedBatch[i] != expected)
+        throw AssertionFailed{};
+    }
+
+    auto limited = bktree->queryBatch(keys, 3, 2);
+    for (std::size_t i = 0; i != keys.size(); ++i) {
+      auto all = bktree->query(keys[i], 3, 99999);
+      if (limited[i].size() != std::min<std::size_t>(2, all.size()) || !std::includes(all.begin(), all.end(), limited[i].begin(), limited[i].end()))
+        throw AssertionFailed{};
+    }
+  });
+
+  spec.it("should query the same values with prefetched node reads", []() {
+    std::mt19937 rng{ 2030 };
+    auto keyValues = randomKeyValues(rng, 2000, 8);
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_prefetch");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+    bktree->erase(keyValues.begin()->first);
+
+    std::unique_ptr<BKTree<LevenshteinDistancePolicy>> pinned{ BKTree<LevenshteinDistancePolicy>::New("/tmp/tmpdb_prefetch", "/tmp/tmpdb_prefetch_i", PinOptions{2}) };
+
+    WorkStealingPool pool{ 2 };
+    forRandomKeys(rng, 100, 8, [&](const std::string& key) {
+      auto expected = bktree->query(key, 2, 99999);
+
+      if (bktree->queryPrefetched(key, 2, 99999, pool, 1) != expected || pinned->queryPrefetched(key, 2, 99999, pool, 4) != expected)
+        throw AssertionFailed{};
+
+      // the same keys are visited in the same order
+      if (bktree->queryPrefetched(key, 3, 3, pool) != bktree->query(key, 3, 3))
+        throw AssertionFailed{};
+    });
+  });
+
+  spec.it("should rethrow the rejection of an executor prefetching node reads", []() {
+    struct RejectingExecutor {
+      void submit(std::function<void()>) {
+        throw std::runtime_error{"rejected"};
+      }
+    };
+
+    std::map<std::string, std::string> keyValues;
+    for (int i = 0; i != 200; ++i) {
+      keyValues["k" + std::to_string(i)] = "v" + std::to_string(i);
+    }
+
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy>>("/tmp/tmpdb_prefetch_rejected");
+    bktree->bulkLoad(keyValues.begin(), keyValues.end());
+
+    RejectingExecutor executor;
+    try {
+      bktree->queryPrefetched("k1", 3, 99999, executor);
+    } catch (const std::runtime_error&) {
+      return;
+    }
+
+    throw AssertionFailed{};
+  });
+
+  spec.it("should place keys of one batch under keys of the same batch", []() {
+    auto bktree = freshTree<BKTree<LevenshteinDistancePolicy, ChildrenKeysCacheImpl, ChildrenKeyPolicyImpl>>("/tmp/tmpdb_batch");
+    bktree->insert("key0", "value0");
+    bktree->insertBatch({ {"key1", "value1"}, {"key2", "value2"}, {"kez3", "value3"}, {"key1", "value1'"} });
+
+    auto q = bktree->query("key1", 1, 999, 2);
+
+    if (q != std::set<std::string>{ "value0", "value1'", "value2" })
+      throw AssertionFailed{};
+  });
 }
 
 int main(void) {  